@@ -0,0 +1,661 @@
+/**
+ * @file archive.c
+ * Streams a directory tree as a tar archive over a single data connection
+ *
+ * Directories are read, and files opened ahead of the send cursor, on the
+ * IO pool; only the writes to the data connection run on the session
+ * thread, as for RETR.
+ *
+ * Public functions:
+ * - send_tar
+ *
+ */
+
+#define _GNU_SOURCE
+#include "archive.h"
+#include "iopool.h"
+#include "transfer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Layout of records returned by the getdents64 syscall
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct tar_entry_s {
+    char *name;
+    unsigned char type;
+    int fd;          // prefetched file fd; else -1
+    int err;         // errno of a failed prefetch; else 0
+    struct stat st;  // stat of the prefetched fd
+} tar_entry_t;
+
+static const char zero_block[TAR_BLOCK_SIZE];
+
+/**
+ * Writes len zero bytes to fd
+ *
+ * @param fd output fd
+ * @param len number of zero bytes
+ * @return 0 on success; else -1
+ */
+static int write_zeros(int fd, off_t len) {
+    while (len > 0) {
+        size_t chunk = len < TAR_BLOCK_SIZE ? len : TAR_BLOCK_SIZE;
+        if (write_all(fd, zero_block, chunk) == -1) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Writes value into a tar numeric field as octal, falling back to the GNU
+ * base-256 encoding when the value does not fit
+ *
+ * @param field header field
+ * @param len length of field
+ * @param value number to encode
+ */
+static void set_number(char *field, size_t len, unsigned long long value) {
+    if (len < 21 && value >> (3 * (len - 1)) != 0) {
+        memset(field, 0, len);
+        for (size_t i = len - 1; i > 0; i--) {
+            field[i] = value & 0xff;
+            value >>= 8;
+        }
+        field[0] = (char)0x80;
+        return;
+    }
+    snprintf(field, len, "%0*llo", (int)len - 1, value);
+}
+
+/**
+ * Writes a single GNU tar header block for an entry
+ *
+ * @param fd output fd
+ * @param name entry name, truncated to the 100 byte name field
+ * @param type tar typeflag
+ * @param mode permission bits
+ * @param size entry size
+ * @param mtime modification time
+ * @return 0 on success; else -1
+ */
+static int write_header_block(int fd, const char *name, char type, mode_t mode,
+                              off_t size, time_t mtime) {
+    char header[TAR_BLOCK_SIZE];
+    memset(header, 0, sizeof(header));
+    strncpy(header, name, 100);
+    set_number(header + 100, 8, mode & 07777);
+    set_number(header + 108, 8, 0);
+    set_number(header + 116, 8, 0);
+    set_number(header + 124, 12, size);
+    set_number(header + 136, 12, mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar  ", 8);
+
+    unsigned int checksum = 0;
+    memset(header + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += (unsigned char)header[i];
+    }
+    snprintf(header + 148, 8, "%06o", checksum);
+    return write_all(fd, header, sizeof(header));
+}
+
+/**
+ * Writes the header for an entry, preceded by a GNU long name entry if the
+ * name does not fit in the header
+ *
+ * @return 0 on success; else -1
+ */
+static int write_header(int fd, const char *name, char type, mode_t mode,
+                        off_t size, time_t mtime) {
+    size_t namelen = strlen(name);
+    if (namelen > 100) {
+        if (write_header_block(fd, "././@LongLink", 'L', 0644, namelen + 1, 0) == -1 ||
+            write_all(fd, name, namelen + 1) == -1 ||
+            write_zeros(fd, (TAR_BLOCK_SIZE - (namelen + 1) % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE) == -1) {
+            return -1;
+        }
+    }
+    return write_header_block(fd, name, type, mode, size, mtime);
+}
+
+/**
+ * Sends size bytes of infd to outfd with sendfile, zero filling if the file
+ * shrinks mid-transfer, followed by padding to the next tar block
+ *
+ * @return 0 on success; else -1
+ */
+static int send_body(int outfd, int infd, off_t size) {
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t sent = sendfile(outfd, infd, &offset, size - offset);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return -1;
+        }
+        if (sent == 0) {
+            break;
+        }
+    }
+    return write_zeros(outfd, (size - offset) + (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+}
+
+/**
+ * Reads all entries of dirfd with getdents64, skipping "." and ".."
+ *
+ * @param dirfd directory fd
+ * @param num_entries return number of entries read
+ * @return entries array that should be freed with free_entries; NULL on error
+ */
+static void free_entries(tar_entry_t *entries, int num_entries);
+
+static tar_entry_t *read_entries(int dirfd, int *num_entries) {
+    char *buf = malloc(GETDENTS_BUF_SIZE);
+    int capacity = 64;
+    int count = 0;
+    tar_entry_t *entries = malloc(capacity * sizeof(tar_entry_t));
+    if (buf == NULL || entries == NULL) {
+        free(buf);
+        free(entries);
+        return NULL;
+    }
+    long nread;
+    while ((nread = syscall(SYS_getdents64, dirfd, buf, GETDENTS_BUF_SIZE)) > 0) {
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64 *dirent = (struct linux_dirent64 *)(buf + pos);
+            pos += dirent->d_reclen;
+            if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+                continue;
+            }
+            if (count == capacity) {
+                tar_entry_t *grown = realloc(entries, capacity * 2 * sizeof(tar_entry_t));
+                if (grown == NULL) {
+                    nread = -1;
+                    break;
+                }
+                entries = grown;
+                capacity *= 2;
+            }
+            entries[count].name = strdup(dirent->d_name);
+            if (entries[count].name == NULL) {
+                nread = -1;
+                break;
+            }
+            entries[count].type = dirent->d_type;
+            entries[count].fd = -1;
+            entries[count].err = 0;
+            count++;
+        }
+        if (nread < 0) {
+            break;
+        }
+    }
+    free(buf);
+    if (nread < 0) {
+        free_entries(entries, count);
+        return NULL;
+    }
+    *num_entries = count;
+    return entries;
+}
+
+static void free_entries(tar_entry_t *entries, int num_entries) {
+    for (int i = 0; i < num_entries; i++) {
+        if (entries[i].fd != -1) {
+            close(entries[i].fd);
+        }
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+/**
+ * Resolves DT_UNKNOWN entry types with fstatat
+ */
+static unsigned char entry_type(int dirfd, tar_entry_t *entry) {
+    if (entry->type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(dirfd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            entry->type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        }
+    }
+    return entry->type;
+}
+
+/**
+ * @return 1 if an open or stat failure means the entry is gone or is no
+ *         longer of the expected type, so it can be skipped; else 0
+ */
+static int is_skippable(int err) {
+    return err == ENOENT || err == ELOOP || err == ENOTDIR;
+}
+
+// Opens and reads a directory on the IO pool
+typedef struct dir_job_s {
+    int parentfd;  // owned; AT_FDCWD for the archived directory
+    char *name;    // owned
+    int flags;
+    int fd;
+    int err;
+    struct stat st;
+    tar_entry_t *entries;
+    int num_entries;
+} dir_job_t;
+
+static void run_dir_job(void *job_data) {
+    dir_job_t *job = job_data;
+    job->fd = openat(job->parentfd, job->name, O_RDONLY | O_DIRECTORY | job->flags);
+    if (job->fd == -1 || fstat(job->fd, &job->st) == -1 ||
+        (job->entries = read_entries(job->fd, &job->num_entries)) == NULL) {
+        job->err = errno != 0 ? errno : EIO;
+        return;
+    }
+    for (int i = 0; i < job->num_entries; i++) {
+        entry_type(job->fd, &job->entries[i]);
+    }
+}
+
+static void free_dir_job(void *job_data) {
+    dir_job_t *job = job_data;
+    if (job->parentfd >= 0) {
+        close(job->parentfd);
+    }
+    if (job->fd != -1) {
+        close(job->fd);
+    }
+    if (job->entries != NULL) {
+        free_entries(job->entries, job->num_entries);
+    }
+    free(job->name);
+    free(job);
+}
+
+/**
+ * Opens directory name under parentfd and reads its entries on the IO pool
+ *
+ * @param parentfd directory fd, or AT_FDCWD if name is absolute
+ * @param name directory name
+ * @param flags extra open flags
+ * @param st return stat of the directory
+ * @param entries return entries with resolved types
+ * @param num_entries return length of entries
+ * @return directory fd; -2 if the directory is gone; -1 on failure
+ */
+static int read_dir(int parentfd, const char *name, int flags, struct stat *st, tar_entry_t **entries,
+                    int *num_entries) {
+    dir_job_t *job = calloc(1, sizeof(dir_job_t));
+    if (job == NULL) {
+        return -1;
+    }
+    job->parentfd = parentfd == AT_FDCWD ? AT_FDCWD : dup(parentfd);
+    job->name = strdup(name);
+    job->flags = flags;
+    job->fd = -1;
+    if (job->parentfd == -1 || job->name == NULL) {
+        free_dir_job(job);
+        return -1;
+    }
+    errno = 0;
+    if (iopool_run(run_dir_job, free_dir_job, job, TAR_IO_TIMEOUT_MS) == -1) {
+        return -1;
+    }
+    int fd = job->fd;
+    if (job->err != 0) {
+        fd = is_skippable(job->err) ? -2 : -1;
+    } else {
+        *st = job->st;
+        *entries = job->entries;
+        *num_entries = job->num_entries;
+        job->fd = -1;
+        job->entries = NULL;
+    }
+    free_dir_job(job);
+    return fd;
+}
+
+// Opens regular files ahead of the send cursor on the IO pool
+typedef struct prefetch_job_s {
+    int dirfd;  // owned
+    int count;
+    struct {
+        char *name;  // owned
+        int fd;
+        int err;
+        struct stat st;
+    } files[TAR_PREFETCH_DEPTH];
+} prefetch_job_t;
+
+static void run_prefetch_job(void *job_data) {
+    prefetch_job_t *job = job_data;
+    for (int i = 0; i < job->count; i++) {
+        int fd = openat(job->dirfd, job->files[i].name, O_RDONLY | O_NOFOLLOW);
+        if (fd != -1 && fstat(fd, &job->files[i].st) == -1) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            job->files[i].err = errno;
+            continue;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        job->files[i].fd = fd;
+    }
+}
+
+static void free_prefetch_job(void *job_data) {
+    prefetch_job_t *job = job_data;
+    for (int i = 0; i < job->count; i++) {
+        if (job->files[i].fd != -1) {
+            close(job->files[i].fd);
+        }
+        free(job->files[i].name);
+    }
+    if (job->dirfd != -1) {
+        close(job->dirfd);
+    }
+    free(job);
+}
+
+/**
+ * Opens regular files ahead of the send cursor and asks the kernel to start
+ * reading them, so disk reads for the next files overlap the current send.
+ * Each entry gets its fd and stat, or the errno of the failed open.
+ *
+ * @param dirfd directory fd
+ * @param entries directory entries
+ * @param num_entries length of entries
+ * @param next index of next entry to prefetch; advanced past prefetched entries
+ * @param open_count number of prefetched fds currently open
+ * @return 0 on success; -1 if the IO pool did not finish in time
+ */
+static int prefetch(int dirfd, tar_entry_t *entries, int num_entries, int *next, int *open_count) {
+    prefetch_job_t *job = malloc(sizeof(prefetch_job_t));
+    if (job == NULL) {
+        return -1;
+    }
+    job->count = 0;
+    int first = *next;
+    while (*open_count + job->count < TAR_PREFETCH_DEPTH && *next < num_entries) {
+        tar_entry_t *entry = &entries[(*next)++];
+        if (entry->type != DT_REG) {
+            continue;
+        }
+        job->files[job->count].name = entry->name;
+        job->files[job->count].fd = -1;
+        job->files[job->count].err = 0;
+        job->count++;
+    }
+    if (job->count == 0) {
+        free(job);
+        return 0;
+    }
+    // The job owns copies so it can outlive the walk if it times out
+    job->dirfd = dup(dirfd);
+    int copied = 0;
+    while (copied < job->count && (job->files[copied].name = strdup(job->files[copied].name)) != NULL) {
+        copied++;
+    }
+    if (job->dirfd == -1 || copied < job->count) {
+        job->count = copied;
+        free_prefetch_job(job);
+        return -1;
+    }
+    if (iopool_run(run_prefetch_job, free_prefetch_job, job, TAR_IO_TIMEOUT_MS) == -1) {
+        return -1;
+    }
+    int file = 0;
+    for (int i = first; i < *next; i++) {
+        if (entries[i].type != DT_REG) {
+            continue;
+        }
+        entries[i].fd = job->files[file].fd;
+        entries[i].err = job->files[file].err;
+        entries[i].st = job->files[file].st;
+        job->files[file].fd = -1;
+        if (entries[i].fd != -1) {
+            (*open_count)++;
+        }
+        file++;
+    }
+    free_prefetch_job(job);
+    return 0;
+}
+
+/**
+ * Archives a regular file entry from its prefetched fd
+ *
+ * @return 1 if entry was archived; 0 if skipped; -1 on read or send failure
+ */
+static int send_regular(int outfd, tar_entry_t *entry, char *path) {
+    int fd = entry->fd;
+    entry->fd = -1;
+    if (fd == -1) {
+        return is_skippable(entry->err) ? 0 : -1;
+    }
+    if (!S_ISREG(entry->st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    int status = write_header(outfd, path, '0', entry->st.st_mode, entry->st.st_size, entry->st.st_mtime);
+    if (status == 0) {
+        status = send_body(outfd, fd, entry->st.st_size);
+    }
+    close(fd);
+    return status == 0 ? 1 : -1;
+}
+
+/**
+ * A directory being archived: its entries and the position of the walk
+ * in them. Frames form an explicit stack on the heap, so nesting depth is
+ * bounded only by the fd limit rather than by the session stack.
+ */
+typedef struct tar_frame_s {
+    int dirfd;
+    tar_entry_t *entries;
+    int num_entries;
+    int next;           // next entry to archive
+    int next_prefetch;  // next entry to prefetch
+    int open_count;     // prefetched fds open in entries
+    char *prefix;       // archive path of directory, either empty or ending in '/'
+} tar_frame_t;
+
+/**
+ * Pushes a frame for a directory read with read_dir, taking ownership of
+ * dirfd, entries and prefix
+ *
+ * @return 0 on success; else -1 and they are freed
+ */
+static int push_frame(tar_frame_t **frames, int *depth, int *capacity, int dirfd, tar_entry_t *entries,
+                      int num_entries, char *prefix) {
+    if (*depth == *capacity) {
+        int grown_capacity = *capacity > 0 ? *capacity * 2 : 16;
+        tar_frame_t *grown = realloc(*frames, grown_capacity * sizeof(tar_frame_t));
+        if (grown == NULL) {
+            free_entries(entries, num_entries);
+            close(dirfd);
+            free(prefix);
+            return -1;
+        }
+        *frames = grown;
+        *capacity = grown_capacity;
+    }
+    tar_frame_t *frame = &(*frames)[(*depth)++];
+    frame->dirfd = dirfd;
+    frame->entries = entries;
+    frame->num_entries = num_entries;
+    frame->next = 0;
+    frame->next_prefetch = 0;
+    frame->open_count = 0;
+    frame->prefix = prefix;
+    return 0;
+}
+
+static void pop_frame(tar_frame_t *frames, int *depth) {
+    tar_frame_t *frame = &frames[--(*depth)];
+    free_entries(frame->entries, frame->num_entries);
+    close(frame->dirfd);
+    free(frame->prefix);
+}
+
+/**
+ * Closes the fds prefetched ahead of the walk in frame, so a deep tree
+ * does not hold TAR_PREFETCH_DEPTH fds open per level. They are opened
+ * again when the walk returns to frame.
+ */
+static void drop_prefetched(tar_frame_t *frame) {
+    for (int i = frame->next; i < frame->next_prefetch; i++) {
+        if (frame->entries[i].fd != -1) {
+            close(frame->entries[i].fd);
+            frame->entries[i].fd = -1;
+        }
+    }
+    frame->next_prefetch = frame->next;
+    frame->open_count = 0;
+}
+
+/**
+ * Archives every regular file and directory under a directory, depth
+ * first. Symlinks and special files are skipped so the archive cannot
+ * reach outside of the tree.
+ *
+ * @param outfd output fd
+ * @param dirfd directory fd; closed
+ * @param entries entries of the directory from read_dir; freed
+ * @param num_entries length of entries
+ * @param prefix archive path of directory, either empty or ending in '/';
+ *               freed
+ * @return number of entries archived; -1 on read or send failure
+ */
+static int send_dir(int outfd, int dirfd, tar_entry_t *entries, int num_entries, char *prefix) {
+    tar_frame_t *frames = NULL;
+    int depth = 0;
+    int capacity = 0;
+    int count = push_frame(&frames, &depth, &capacity, dirfd, entries, num_entries, prefix);
+    while (depth > 0 && count != -1) {
+        tar_frame_t *frame = &frames[depth - 1];
+        if (frame->next == frame->num_entries) {
+            pop_frame(frames, &depth);
+            continue;
+        }
+        // Refill once half the prefetched files were sent, and always
+        // before the next entry would be sent unopened
+        if ((frame->next_prefetch <= frame->next || frame->open_count < TAR_PREFETCH_DEPTH / 2) &&
+            prefetch(frame->dirfd, frame->entries, frame->num_entries, &frame->next_prefetch,
+                     &frame->open_count) == -1) {
+            count = -1;
+            break;
+        }
+        tar_entry_t *entry = &frame->entries[frame->next++];
+        if (entry->fd != -1) {
+            frame->open_count--;
+        }
+        // Room for the name and the "/" of a directory
+        char *path = malloc(strlen(frame->prefix) + strlen(entry->name) + 2);
+        if (path == NULL) {
+            count = -1;
+            break;
+        }
+        sprintf(path, "%s%s", frame->prefix, entry->name);
+
+        if (entry->type == DT_REG) {
+            int status = send_regular(outfd, entry, path);
+            count = status == -1 ? -1 : count + status;
+            free(path);
+        } else if (entry->type == DT_DIR) {
+            strcat(path, "/");
+            struct stat st;
+            tar_entry_t *subentries;
+            int num_subentries;
+            int subdirfd = read_dir(frame->dirfd, entry->name, O_NOFOLLOW, &st, &subentries, &num_subentries);
+            if (subdirfd >= 0 && write_header(outfd, path, '5', st.st_mode, 0, st.st_mtime) == -1) {
+                free_entries(subentries, num_subentries);
+                close(subdirfd);
+                subdirfd = -1;
+            }
+            if (subdirfd < 0) {
+                count = subdirfd == -1 ? -1 : count;
+                free(path);
+                continue;
+            }
+            count++;
+            drop_prefetched(frame);
+            if (push_frame(&frames, &depth, &capacity, subdirfd, subentries, num_subentries, path) == -1) {
+                count = -1;
+            }
+        } else {
+            free(path);
+        }
+    }
+
+    while (depth > 0) {
+        pop_frame(frames, &depth);
+    }
+    free(frames);
+    return count;
+}
+
+/**
+ * Sends a tar archive of the directory tree at dirpath to fd
+ *
+ * @param fd output fd
+ * @param dirpath absolute path of directory to archive
+ * @param name archive path of the top-level directory; empty to archive the
+ *             contents of dirpath without a top-level directory entry
+ * @return number of entries archived if successful; else -1
+ */
+int send_tar(int fd, char *dirpath, char *name) {
+    struct stat st;
+    tar_entry_t *entries;
+    int num_entries;
+    int dirfd = read_dir(AT_FDCWD, dirpath, 0, &st, &entries, &num_entries);
+    if (dirfd < 0) {
+        return -1;
+    }
+
+    int count = 0;
+    char *prefix = malloc(strlen(name) + 2);
+    if (prefix == NULL) {
+        free_entries(entries, num_entries);
+        close(dirfd);
+        return -1;
+    }
+    strcpy(prefix, name);
+    if (prefix[0] != '\0') {
+        strcat(prefix, "/");
+        if (write_header(fd, prefix, '5', st.st_mode, 0, st.st_mtime) == -1) {
+            free_entries(entries, num_entries);
+            free(prefix);
+            close(dirfd);
+            return -1;
+        }
+        count = 1;
+    }
+    int dircount = send_dir(fd, dirfd, entries, num_entries, prefix);
+    count = dircount == -1 ? -1 : count + dircount;
+
+    // End of archive is marked by two zero blocks
+    if (count == -1 || write_zeros(fd, 2 * TAR_BLOCK_SIZE) == -1) {
+        return -1;
+    }
+    return count;
+}
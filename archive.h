@@ -0,0 +1,13 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <sys/types.h>
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_PREFETCH_DEPTH 8
+#define GETDENTS_BUF_SIZE 32768
+#define TAR_IO_TIMEOUT_MS 5000  // wait for the IO pool before failing the archive
+
+int send_tar(int fd, char *dirpath, char *name);
+
+#endif
@@ -0,0 +1,66 @@
+/**
+ * @file arena.c
+ * Fixed-size bump allocator for per-command scratch buffers
+ *
+ * Public functions:
+ * - arena_init
+ * - arena_alloc
+ * - arena_reset
+ * - arena_free
+ *
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+
+/**
+ * Allocates size bytes of backing memory for arena
+ *
+ * @param arena
+ * @param size capacity in bytes
+ * @return 1 on success; else 0
+ */
+int arena_init(arena_t *arena, size_t size) {
+    arena->base = malloc(size);
+    arena->size = arena->base != NULL ? size : 0;
+    arena->used = 0;
+    return arena->base != NULL;
+}
+
+/**
+ * Allocates size bytes from arena, valid until the next arena_reset
+ *
+ * @param arena
+ * @param size number of bytes
+ * @return pointer to memory; NULL if arena is exhausted
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (start + size > arena->size) {
+        return NULL;
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+/**
+ * Releases every allocation of arena at once
+ *
+ * @param arena
+ */
+void arena_reset(arena_t *arena) {
+    arena->used = 0;
+}
+
+/**
+ * Frees backing memory of arena
+ *
+ * @param arena
+ */
+void arena_free(arena_t *arena) {
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 16
+
+typedef struct arena_s {
+    char *base;
+    size_t size;
+    size_t used;
+} arena_t;
+
+int arena_init(arena_t *arena, size_t size);
+
+void *arena_alloc(arena_t *arena, size_t size);
+
+void arena_reset(arena_t *arena);
+
+void arena_free(arena_t *arena);
+
+#endif
@@ -0,0 +1,152 @@
+/**
+ * @file ascii.c
+ * Line ending translation for ASCII type transfers
+ *
+ * Newlines are located a vector at a time with AVX2 or SSE2 where the CPU
+ * supports it, so runs of text without newlines are copied as whole vectors
+ * and only the newlines themselves are handled individually.
+ *
+ * Public functions:
+ * - lf_to_crlf
+ *
+ */
+
+#include "ascii.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ASCII_X86 1
+#endif
+
+/**
+ * Expands newlines one byte at a time from in[i]
+ *
+ * @return bytes written to out
+ */
+static size_t convert_scalar(const char *in, size_t i, size_t len, char *out, char last) {
+    size_t written = 0;
+    while (i < len) {
+        const char *newline = memchr(in + i, '\n', len - i);
+        size_t end = newline != NULL ? (size_t)(newline - in) : len;
+        memcpy(out + written, in + i, end - i);
+        written += end - i;
+        if (newline == NULL) {
+            break;
+        }
+        if ((end > 0 ? in[end - 1] : last) != '\r') {
+            out[written++] = '\r';
+        }
+        out[written++] = '\n';
+        i = end + 1;
+    }
+    return written;
+}
+
+#ifdef ASCII_X86
+/**
+ * Vector loops: blocks without newlines are stored whole. In a block with
+ * newlines, each segment up to a newline is stored as a whole vector too,
+ * and the bytes past the segment are overwritten by the next store. A
+ * segment whose vector would extend past the end of in, which only happens
+ * in the last full block, is copied exactly instead.
+ */
+__attribute__((target("sse2")))
+static size_t convert_sse2(const char *in, size_t len, char *out, char last) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+    size_t written = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(in + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        size_t start = i;
+        while (mask != 0) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (start + 16 <= len) {
+                _mm_storeu_si128((__m128i *)(out + written), _mm_loadu_si128((const __m128i *)(in + start)));
+            } else {
+                memcpy(out + written, in + start, pos - start);
+            }
+            written += pos - start;
+            if ((pos > 0 ? in[pos - 1] : last) != '\r') {
+                out[written++] = '\r';
+            }
+            out[written++] = '\n';
+            start = pos + 1;
+            mask &= mask - 1;
+        }
+        if (start + 16 <= len) {
+            _mm_storeu_si128((__m128i *)(out + written), _mm_loadu_si128((const __m128i *)(in + start)));
+        } else {
+            memcpy(out + written, in + start, i + 16 - start);
+        }
+        written += i + 16 - start;
+    }
+    return written + convert_scalar(in, i, len, out + written, last);
+}
+
+__attribute__((target("avx2")))
+static size_t convert_avx2(const char *in, size_t len, char *out, char last) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    size_t written = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(in + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        size_t start = i;
+        while (mask != 0) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (start + 32 <= len) {
+                _mm256_storeu_si256((__m256i *)(out + written), _mm256_loadu_si256((const __m256i *)(in + start)));
+            } else {
+                memcpy(out + written, in + start, pos - start);
+            }
+            written += pos - start;
+            if ((pos > 0 ? in[pos - 1] : last) != '\r') {
+                out[written++] = '\r';
+            }
+            out[written++] = '\n';
+            start = pos + 1;
+            mask &= mask - 1;
+        }
+        if (start + 32 <= len) {
+            _mm256_storeu_si256((__m256i *)(out + written), _mm256_loadu_si256((const __m256i *)(in + start)));
+        } else {
+            memcpy(out + written, in + start, i + 32 - start);
+        }
+        written += i + 32 - start;
+    }
+    return written + convert_scalar(in, i, len, out + written, last);
+}
+#endif
+
+/**
+ * Converts bare LF line endings of in to CRLF. Existing CRLF pairs are kept
+ * as they are, including pairs split across consecutive calls.
+ *
+ * @param in input bytes
+ * @param len length of in
+ * @param out output buffer of at least 2 * len + ASCII_OUT_SLACK bytes
+ * @param last last byte of the previous chunk of the stream, updated on
+ * return; '\0' at the start of a stream
+ * @return bytes written to out
+ */
+size_t lf_to_crlf(const char *in, size_t len, char *out, char *last) {
+    if (len == 0) {
+        return 0;
+    }
+    size_t written;
+#ifdef ASCII_X86
+    if (__builtin_cpu_supports("avx2")) {
+        written = convert_avx2(in, len, out, *last);
+    } else if (__builtin_cpu_supports("sse2")) {
+        written = convert_sse2(in, len, out, *last);
+    } else
+#endif
+    {
+        written = convert_scalar(in, 0, len, out, *last);
+    }
+    *last = in[len - 1];
+    return written;
+}
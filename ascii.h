@@ -0,0 +1,11 @@
+#ifndef __ASCII_H__
+#define __ASCII_H__
+
+#include <stddef.h>
+
+#define ASCII_CHUNK_SIZE (64 * 1024)
+#define ASCII_OUT_SLACK 32  // vector stores may write past the converted bytes
+
+size_t lf_to_crlf(const char *in, size_t len, char *out, char *last);
+
+#endif
@@ -0,0 +1,481 @@
+/**
+ * @file coalesce.c
+ * Shares file reads between sessions downloading the same file at once
+ *
+ * Sessions sending the same file (same device, inode, mtime and size) join
+ * a group. Each chunk of the file is read once, by whichever session needs
+ * it first, into a refcounted buffer that every session of the group then
+ * writes to its own data connection. Chunks are retained in windows of the
+ * most recent coalesce_chunks chunks of a sequence of reads. A session that
+ * joins after the start of the file was dropped, or falls behind a window,
+ * starts a trailing window of its own that later sessions can share, and
+ * moves into whichever window holds its next chunk, so sessions re-attach
+ * as soon as their next chunk is still buffered. Only once a group has
+ * COALESCE_MAX_WINDOWS windows does a session read chunks on its own.
+ * Groups are spread over COALESCE_LOCK_SHARDS locks by inode, so
+ * downloads of different files do not contend.
+ * Files at least direct_threshold bytes are read with O_DIRECT, so each
+ * chunk costs one disk read regardless of the number of readers; other
+ * large files get the readahead window of send_file ahead of the newest
+ * chunk and have their pages dropped behind the oldest. A session whose
+ * chunk ends before the file does, because the file shrank or could not be
+ * read, sends the rest with send_file_range from where it got to.
+ *
+ * Public functions:
+ * - coalesce_send
+ * - coalesce_get_stats
+ *
+ */
+
+#define _GNU_SOURCE
+#include "coalesce.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "transfer.h"
+
+off_t coalesce_min = 0;
+int coalesce_chunks = DEFAULT_COALESCE_CHUNKS;
+
+typedef struct coalesce_chunk_s {
+    int refs;     // the window plus each session using the chunk
+    int loading;  // 1 until the chunk has been read
+    ssize_t len;  // bytes read; -1 on read error
+    char *data;
+} coalesce_chunk_t;
+
+// Retained chunks [lo, hi) of one sequence of reads
+typedef struct coalesce_window_s {
+    long lo;
+    long hi;
+    int readers;    // sessions whose last chunk came from this window
+    off_t dropped;  // pages before this were dropped from the page cache
+    coalesce_chunk_t **chunks;  // chunk k is at chunks[k % max_chunks]
+    struct coalesce_window_s *next;
+} coalesce_window_t;
+
+typedef struct coalesce_shard_s coalesce_shard_t;
+
+typedef struct coalesce_group_s {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    int fd;
+    int direct;  // fd was opened with O_DIRECT
+    int subscribers;
+    int max_chunks;
+    int num_windows;
+    coalesce_window_t *windows;
+    coalesce_shard_t *shard;
+    pthread_cond_t cond;
+    struct coalesce_group_s *next;
+} coalesce_group_t;
+
+// Guards the groups of its files, their windows and chunk refs
+struct coalesce_shard_s {
+    pthread_mutex_t lock;
+    coalesce_group_t *groups;
+};
+
+static coalesce_shard_t shards[COALESCE_LOCK_SHARDS] = {
+    [0 ... COALESCE_LOCK_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+// Updated with atomic operations
+static coalesce_stats_t stats;
+
+static coalesce_chunk_t *alloc_chunk() {
+    coalesce_chunk_t *chunk = malloc(sizeof(coalesce_chunk_t));
+    if (chunk == NULL) {
+        return NULL;
+    }
+    if (posix_memalign((void **)&chunk->data, DIRECT_ALIGN, COALESCE_CHUNK_SIZE) != 0) {
+        free(chunk);
+        return NULL;
+    }
+    chunk->refs = 0;
+    chunk->loading = 1;
+    chunk->len = 0;
+    return chunk;
+}
+
+/**
+ * Drops a reference to chunk, freeing it with the last one. Caller holds
+ * the shard lock of its group.
+ */
+static void release_chunk(coalesce_chunk_t *chunk) {
+    if (--chunk->refs == 0) {
+        __atomic_sub_fetch(&stats.retained_bytes, COALESCE_CHUNK_SIZE, __ATOMIC_RELAXED);
+        free(chunk->data);
+        free(chunk);
+    }
+}
+
+/**
+ * Opens the fd a group reads from: infd reopened through /proc with
+ * O_DIRECT if the file is large enough, else a duplicate of infd. Either
+ * way the group reads the file that was looked up.
+ *
+ * @param direct return 1 if the fd bypasses the page cache
+ */
+static int open_group_fd(int infd, const struct stat *st, int *direct) {
+    char proc_path[32];
+    *direct = 0;
+    if (direct_threshold > 0 && st->st_size >= direct_threshold) {
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", infd);
+        int fd = open(proc_path, O_RDONLY | O_DIRECT);
+        if (fd != -1) {
+            *direct = 1;
+            return fd;
+        }
+    }
+    int fd = dup(infd);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (st->st_size >= LARGE_FILE_THRESHOLD) {
+            posix_fadvise(fd, 0, READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+        }
+    }
+    return fd;
+}
+
+/**
+ * Reads up to COALESCE_CHUNK_SIZE bytes at offset, retrying interrupted
+ * and short reads so that only the end of the file yields a short chunk
+ *
+ * @return bytes read, short if a read failed after some bytes (such as an
+ *         O_DIRECT read resuming unaligned); -1 if nothing could be read
+ */
+static ssize_t read_chunk(int fd, char *data, off_t offset) {
+    size_t len = 0;
+    while (len < COALESCE_CHUNK_SIZE) {
+        ssize_t n = pread(fd, data + len, COALESCE_CHUNK_SIZE - len, offset + len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 && len == 0 ? -1 : (ssize_t)len;
+        }
+        len += n;
+    }
+    return len;
+}
+
+/**
+ * Advises the kernel on the cached pages of a non-O_DIRECT group after
+ * chunk k was read into window, as send_file does: each time chunk k
+ * starts a new READAHEAD_WINDOW the next window is requested, and pages
+ * more than a window behind the oldest retained chunk are dropped. Caller
+ * holds the shard lock; the calls are made after it is released.
+ *
+ * @param willneed return start of the range to read ahead; -1 for none
+ * @param dontneed return [dontneed, dropped_end) to drop
+ */
+static void plan_readahead(coalesce_group_t *group, coalesce_window_t *window, long k, off_t *willneed,
+                           off_t *dontneed, off_t *dropped_end) {
+    off_t offset = (off_t)k * COALESCE_CHUNK_SIZE;
+    *willneed = -1;
+    *dontneed = *dropped_end = 0;
+    if (group->direct || group->size < LARGE_FILE_THRESHOLD) {
+        return;
+    }
+    if (offset % READAHEAD_WINDOW == 0) {
+        *willneed = offset + READAHEAD_WINDOW;
+    }
+    off_t oldest = (off_t)window->lo * COALESCE_CHUNK_SIZE;
+    if (oldest - READAHEAD_WINDOW > window->dropped) {
+        *dontneed = window->dropped;
+        *dropped_end = oldest - READAHEAD_WINDOW;
+        window->dropped = *dropped_end;
+    }
+}
+
+static coalesce_shard_t *to_shard(const struct stat *st) {
+    return &shards[(st->st_ino ^ st->st_dev) % COALESCE_LOCK_SHARDS];
+}
+
+/**
+ * Finds the group of the file described by st, creating it if needed, and
+ * subscribes to it. Caller holds the lock of shard.
+ *
+ * @return group; NULL if a new group could not be created
+ */
+static coalesce_group_t *join_group(coalesce_shard_t *shard, int infd, const struct stat *st) {
+    coalesce_group_t *group;
+    for (group = shard->groups; group != NULL; group = group->next) {
+        if (group->dev == st->st_dev && group->ino == st->st_ino && group->size == st->st_size &&
+            group->mtime.tv_sec == st->st_mtim.tv_sec && group->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+            group->subscribers++;
+            __atomic_add_fetch(&stats.subscribers, 1, __ATOMIC_RELAXED);
+            return group;
+        }
+    }
+    group = malloc(sizeof(coalesce_group_t));
+    if (group == NULL) {
+        return NULL;
+    }
+    group->fd = open_group_fd(infd, st, &group->direct);
+    if (group->fd == -1) {
+        free(group);
+        return NULL;
+    }
+    group->dev = st->st_dev;
+    group->ino = st->st_ino;
+    group->mtime = st->st_mtim;
+    group->size = st->st_size;
+    group->subscribers = 1;
+    group->max_chunks = coalesce_chunks;
+    group->num_windows = 0;
+    group->windows = NULL;
+    group->shard = shard;
+    pthread_cond_init(&group->cond, NULL);
+    group->next = shard->groups;
+    shard->groups = group;
+    __atomic_add_fetch(&stats.groups, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.subscribers, 1, __ATOMIC_RELAXED);
+    return group;
+}
+
+/**
+ * Adds an empty window starting at chunk k to group. Caller holds the
+ * shard lock.
+ *
+ * @return window; NULL if it could not be allocated
+ */
+static coalesce_window_t *open_window(coalesce_group_t *group, long k) {
+    coalesce_window_t *window = malloc(sizeof(coalesce_window_t));
+    if (window == NULL) {
+        return NULL;
+    }
+    window->chunks = calloc(group->max_chunks, sizeof(coalesce_chunk_t *));
+    if (window->chunks == NULL) {
+        free(window);
+        return NULL;
+    }
+    window->lo = k;
+    window->hi = k;
+    window->readers = 0;
+    window->dropped = (off_t)k * COALESCE_CHUNK_SIZE;
+    window->next = group->windows;
+    group->windows = window;
+    group->num_windows++;
+    return window;
+}
+
+/**
+ * Moves a session from window *current to window next, either may be
+ * NULL, and frees the window it leaves if no other session reads from it.
+ * Caller holds the shard lock.
+ */
+static void move_reader(coalesce_group_t *group, coalesce_window_t **current, coalesce_window_t *next) {
+    coalesce_window_t *window = *current;
+    *current = next;
+    if (next != NULL) {
+        next->readers++;
+    }
+    if (window == NULL || --window->readers > 0) {
+        return;
+    }
+    coalesce_window_t **link = &group->windows;
+    while (*link != window) {
+        link = &(*link)->next;
+    }
+    *link = window->next;
+    for (long k = window->lo; k < window->hi; k++) {
+        release_chunk(window->chunks[k % group->max_chunks]);
+    }
+    free(window->chunks);
+    free(window);
+    group->num_windows--;
+}
+
+/**
+ * Unsubscribes from group, freeing it after the last subscriber. Caller
+ * holds the shard lock.
+ */
+static void leave_group(coalesce_group_t *group, coalesce_window_t *window) {
+    move_reader(group, &window, NULL);
+    __atomic_sub_fetch(&stats.subscribers, 1, __ATOMIC_RELAXED);
+    if (--group->subscribers > 0) {
+        return;
+    }
+    coalesce_group_t **link = &group->shard->groups;
+    while (*link != group) {
+        link = &(*link)->next;
+    }
+    *link = group->next;
+    close(group->fd);
+    pthread_cond_destroy(&group->cond);
+    free(group);
+    __atomic_sub_fetch(&stats.groups, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Gets chunk k of group for a session reading from window *current: a
+ * chunk retained by any window, which the session moves to, waiting for it
+ * if it is still being read; else a new chunk read by this session at the
+ * end of its window, of another window ending at k, or of a new trailing
+ * window. Caller holds the shard lock.
+ *
+ * @return referenced chunk; NULL if the session should read k itself
+ */
+static coalesce_chunk_t *get_chunk(coalesce_group_t *group, coalesce_window_t **current, long k) {
+    pthread_mutex_t *lock = &group->shard->lock;
+    coalesce_chunk_t *chunk;
+    coalesce_window_t *window;
+    for (window = group->windows; window != NULL; window = window->next) {
+        if (k >= window->lo && k < window->hi) {
+            move_reader(group, current, window);
+            chunk = window->chunks[k % group->max_chunks];
+            chunk->refs++;
+            while (chunk->loading) {
+                pthread_cond_wait(&group->cond, lock);
+            }
+            __atomic_add_fetch(&stats.shared_sends, 1, __ATOMIC_RELAXED);
+            return chunk;
+        }
+    }
+    window = *current != NULL && (*current)->hi == k ? *current : NULL;
+    for (coalesce_window_t *other = group->windows; other != NULL && window == NULL; other = other->next) {
+        if (other->hi == k) {
+            window = other;
+        }
+    }
+    if (window == NULL && group->num_windows < COALESCE_MAX_WINDOWS) {
+        window = open_window(group, k);
+    }
+    if (window == NULL || (chunk = alloc_chunk()) == NULL) {
+        // Keep retained chunks only for sessions that read them
+        move_reader(group, current, NULL);
+        return NULL;
+    }
+    move_reader(group, current, window);
+    if (window->hi - window->lo == group->max_chunks) {
+        release_chunk(window->chunks[window->lo % group->max_chunks]);
+        window->lo++;
+    }
+    chunk->refs = 2;
+    window->chunks[k % group->max_chunks] = chunk;
+    window->hi++;
+    __atomic_add_fetch(&stats.retained_bytes, COALESCE_CHUNK_SIZE, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.chunk_reads, 1, __ATOMIC_RELAXED);
+    off_t willneed, dontneed, dropped_end;
+    plan_readahead(group, window, k, &willneed, &dontneed, &dropped_end);
+
+    pthread_mutex_unlock(lock);
+    if (willneed != -1) {
+        posix_fadvise(group->fd, willneed, READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+    }
+    if (dropped_end > dontneed) {
+        posix_fadvise(group->fd, dontneed, dropped_end - dontneed, POSIX_FADV_DONTNEED);
+    }
+    chunk->len = read_chunk(group->fd, chunk->data, (off_t)k * COALESCE_CHUNK_SIZE);
+    pthread_mutex_lock(lock);
+    chunk->loading = 0;
+    pthread_cond_broadcast(&group->cond);
+    return chunk;
+}
+
+/**
+ * Sends file infd to outfd, sharing reads with other sessions sending the
+ * same file. Falls back to send_file if a group cannot be set up.
+ *
+ * @param outfd output fd
+ * @param infd file fd
+ * @param size size of file
+ * @return bytes sent, less than size if the file shrank; -1 on failure
+ */
+off_t coalesce_send(int outfd, int infd, off_t size) {
+    struct stat st;
+    if (fstat(infd, &st) == -1 || st.st_size != size) {
+        return send_file(outfd, infd, size);
+    }
+    coalesce_shard_t *shard = to_shard(&st);
+    pthread_mutex_lock(&shard->lock);
+    coalesce_group_t *group = join_group(shard, infd, &st);
+    pthread_mutex_unlock(&shard->lock);
+    if (group == NULL) {
+        return send_file(outfd, infd, size);
+    }
+
+    // Every chunk before k was full, so chunk k starts at sent
+    coalesce_window_t *window = NULL;
+    char *private_buf = NULL;
+    off_t sent = 0;
+    int finish_cached = 0;
+    for (long k = 0; sent < size; k++) {
+        pthread_mutex_lock(&shard->lock);
+        coalesce_chunk_t *chunk = get_chunk(group, &window, k);
+        pthread_mutex_unlock(&shard->lock);
+        if (chunk == NULL) {
+            __atomic_add_fetch(&stats.private_reads, 1, __ATOMIC_RELAXED);
+        }
+
+        const char *data;
+        ssize_t len;
+        if (chunk != NULL) {
+            data = chunk->data;
+            len = chunk->len;
+        } else {
+            if (private_buf == NULL &&
+                posix_memalign((void **)&private_buf, DIRECT_ALIGN, COALESCE_CHUNK_SIZE) != 0) {
+                private_buf = NULL;
+                sent = -1;
+                break;
+            }
+            data = private_buf;
+            len = read_chunk(group->fd, private_buf, sent);
+        }
+        if (len > size - sent) {
+            len = size - sent;  // file grew
+        }
+        int status = len > 0 ? write_all(outfd, data, len) : 0;
+
+        if (chunk != NULL) {
+            pthread_mutex_lock(&shard->lock);
+            release_chunk(chunk);
+            pthread_mutex_unlock(&shard->lock);
+        }
+        if (status == -1) {
+            sent = -1;
+            break;
+        }
+        if (len < COALESCE_CHUNK_SIZE && (len < 0 || sent + len < size)) {
+            // The chunk ended early; finish from the real offset
+            sent += len > 0 ? len : 0;
+            finish_cached = 1;
+            break;
+        }
+        sent += len;
+    }
+
+    free(private_buf);
+    pthread_mutex_lock(&shard->lock);
+    leave_group(group, window);
+    pthread_mutex_unlock(&shard->lock);
+    if (finish_cached) {
+        off_t rest = send_file_range(outfd, infd, sent, size - sent);
+        sent = rest == -1 ? -1 : sent + rest;
+    }
+    return sent;
+}
+
+/**
+ * Copies a snapshot of coalescing counters into out
+ *
+ * @param out return stats
+ */
+void coalesce_get_stats(coalesce_stats_t *out) {
+    out->groups = __atomic_load_n(&stats.groups, __ATOMIC_RELAXED);
+    out->subscribers = __atomic_load_n(&stats.subscribers, __ATOMIC_RELAXED);
+    out->retained_bytes = __atomic_load_n(&stats.retained_bytes, __ATOMIC_RELAXED);
+    out->chunk_reads = __atomic_load_n(&stats.chunk_reads, __ATOMIC_RELAXED);
+    out->shared_sends = __atomic_load_n(&stats.shared_sends, __ATOMIC_RELAXED);
+    out->private_reads = __atomic_load_n(&stats.private_reads, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,30 @@
+#ifndef __COALESCE_H__
+#define __COALESCE_H__
+
+#include <sys/types.h>
+
+#define COALESCE_CHUNK_SIZE (1024 * 1024)  // multiple of DIRECT_ALIGN
+#define DEFAULT_COALESCE_CHUNKS 16
+#define MIN_COALESCE_CHUNKS 2
+#define COALESCE_MAX_WINDOWS 4   // chunk windows per file before sessions read on their own
+#define COALESCE_LOCK_SHARDS 16  // locks groups are spread over by inode
+
+typedef struct coalesce_stats_s {
+    int groups;
+    int subscribers;
+    size_t retained_bytes;
+    unsigned long chunk_reads;    // chunks read once into shared buffers
+    unsigned long shared_sends;   // chunks sent from a buffer read by another session
+    unsigned long private_reads;  // chunks read by a session with no chunk window to share
+} coalesce_stats_t;
+
+// Files at least this large are coalesced; 0 disables coalescing
+extern off_t coalesce_min;
+// Chunks retained per file for sessions behind the reader
+extern int coalesce_chunks;
+
+off_t coalesce_send(int outfd, int infd, off_t size);
+
+void coalesce_get_stats(coalesce_stats_t *stats);
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * @file fswatch.c
+ * Shared inotify watcher notifying listeners of directory changes
+ *
+ * Public functions:
+ * - fswatch_init
+ * - fswatch_listen
+ * - fswatch_add_dir
+ *
+ */
+
+#include "fswatch.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int inotifyfd = -1;
+static pthread_t watch_thread;
+static fswatch_fn_t listeners[FSWATCH_MAX_LISTENERS];
+static int num_listeners;
+
+// Watch descriptor to watched directory path
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **watch_paths;
+static int watch_capacity;
+
+static void notify(const char *dirpath, const char *name, uint32_t mask) {
+    for (int i = 0; i < num_listeners; i++) {
+        listeners[i](dirpath, name, mask);
+    }
+}
+
+/**
+ * Reads inotify events and forwards them to listeners
+ *
+ * @param arg unused
+ * @return NULL
+ */
+static void *run_watch(void *arg) {
+    char *buf = malloc(FSWATCH_BUF_SIZE);
+    ssize_t len;
+    while ((len = read(inotifyfd, buf, FSWATCH_BUF_SIZE)) > 0) {
+        for (ssize_t pos = 0; pos < len;) {
+            struct inotify_event *event = (struct inotify_event *)(buf + pos);
+            pos += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                notify(NULL, NULL, event->mask);
+                continue;
+            }
+
+            pthread_mutex_lock(&watch_lock);
+            char *dirpath = NULL;
+            if (event->wd >= 0 && event->wd < watch_capacity && watch_paths[event->wd] != NULL) {
+                dirpath = strdup(watch_paths[event->wd]);
+                if (event->mask & IN_IGNORED) {
+                    free(watch_paths[event->wd]);
+                    watch_paths[event->wd] = NULL;
+                }
+            }
+            pthread_mutex_unlock(&watch_lock);
+
+            if (dirpath != NULL) {
+                notify(dirpath, event->len > 0 ? event->name : NULL, event->mask);
+            }
+            free(dirpath);
+
+            // A moved directory keeps its watch under the old path, so drop
+            // it; it is watched again under the new path when next added
+            if (event->mask & IN_MOVE_SELF) {
+                inotify_rm_watch(inotifyfd, event->wd);
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Creates the inotify instance and starts the watch thread
+ *
+ * @return 1 on success; else 0
+ */
+int fswatch_init() {
+    inotifyfd = inotify_init1(IN_CLOEXEC);
+    if (inotifyfd == -1) {
+        return 0;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, FSWATCH_STACK_SIZE);
+    int status = pthread_create(&watch_thread, &attr, run_watch, NULL);
+    pthread_attr_destroy(&attr);
+    if (status != 0) {
+        close(inotifyfd);
+        inotifyfd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Registers fn to be called for every change. Listeners must be registered
+ * before directories are watched.
+ *
+ * @param fn listener
+ * @return 1 on success; else 0
+ */
+int fswatch_listen(fswatch_fn_t fn) {
+    if (num_listeners == FSWATCH_MAX_LISTENERS) {
+        return 0;
+    }
+    listeners[num_listeners++] = fn;
+    return 1;
+}
+
+/**
+ * Watches dirpath for changes to itself and its entries. Watching a
+ * directory twice is harmless.
+ *
+ * @param dirpath absolute directory path
+ * @return 1 if dirpath is watched; else 0
+ */
+int fswatch_add_dir(const char *dirpath) {
+    if (inotifyfd == -1) {
+        return 0;
+    }
+    int wd = inotify_add_watch(inotifyfd, dirpath, FSWATCH_MASK);
+    if (wd == -1) {
+        return 0;
+    }
+    pthread_mutex_lock(&watch_lock);
+    if (wd >= watch_capacity) {
+        int capacity = watch_capacity > 0 ? watch_capacity : 64;
+        while (capacity <= wd) {
+            capacity *= 2;
+        }
+        char **paths = realloc(watch_paths, capacity * sizeof(char *));
+        if (paths == NULL) {
+            pthread_mutex_unlock(&watch_lock);
+            inotify_rm_watch(inotifyfd, wd);
+            return 0;
+        }
+        memset(paths + watch_capacity, 0, (capacity - watch_capacity) * sizeof(char *));
+        watch_paths = paths;
+        watch_capacity = capacity;
+    }
+    if (watch_paths[wd] == NULL || strcmp(watch_paths[wd], dirpath) != 0) {
+        free(watch_paths[wd]);
+        watch_paths[wd] = strdup(dirpath);
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return 1;
+}
@@ -0,0 +1,28 @@
+#ifndef __FSWATCH_H__
+#define __FSWATCH_H__
+
+#include <stdint.h>
+#include <sys/inotify.h>
+
+#define FSWATCH_MASK                                                          \
+    (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM |          \
+     IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define FSWATCH_MAX_LISTENERS 4
+#define FSWATCH_BUF_SIZE 16384
+#define FSWATCH_STACK_SIZE (64 * 1024)
+
+/**
+ * Called from the watch thread for each change. name is NULL for changes to
+ * dirpath itself, including the end of its watch (IN_IGNORED); dirpath is
+ * also NULL if events were lost and every directory should be treated as
+ * changed.
+ */
+typedef void (*fswatch_fn_t)(const char *dirpath, const char *name, uint32_t mask);
+
+int fswatch_init();
+
+int fswatch_listen(fswatch_fn_t fn);
+
+int fswatch_add_dir(const char *dirpath);
+
+#endif
@@ -7,13 +7,29 @@
  *
  */
 
+#define _GNU_SOURCE
 #include "ftpservice.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
-#include "dir.h"
+#include "coalesce.h"
+#include "iopool.h"
+#include "nameindex.h"
+#include "statcache.h"
+#include "strpool.h"
+#include "tls.h"
+#include "trace.h"
+#include "transfer.h"
 
 /**
  * Main loop for an FTP session of a user with the given control connection fd
@@ -24,30 +40,57 @@
 void *handle_session(void *session_data) {
     client_session_t *session = session_data;
     close_connection(&session->data_connection);
+    session->cwd = NULL;
+    session->tls = NULL;
+    session->pbsz_set = 0;
+    session->protect_data = 0;
+    session->ascii_type = 0;
+    if (!arena_init(&session->arena, SESSION_ARENA_SIZE)) {
+        dprintf(session->clientfd, "421 Out of memory.\r\n");
+        close(session->clientfd);
+        __atomic_store_n(&session->state, STATE_EXITED, __ATOMIC_RELEASE);
+        return NULL;
+    }
 
     // Respond connection successful
     dprintf(session->clientfd, "220 (JSftp 1.0)\r\n");
+    trace_write(session->trace_id, TRACE_OPEN, trace_now_us(), 0, NULL, 0);
 
     // Session loop
-    char recvbuf[1024];
+    char *recvbuf;
+    char *cmdline;
     char *cmdstr;
     int argc;
     char *args[MAX_NUM_ARGS];
     int recvsize;
     char *saveptr = NULL;  // for thread-safe strtok_r
     while (1) {
-        recvsize = read(session->clientfd, &recvbuf, sizeof(recvbuf));
+        arena_reset(&session->arena);
+        recvbuf = arena_alloc(&session->arena, CMD_BUF_LEN);
+        if (recvbuf == NULL) {
+            dprintf(session->clientfd, "421 Out of memory, closing control connection.\r\n");
+            break;
+        }
+        recvsize = read(session->clientfd, recvbuf, CMD_BUF_LEN);
         if (recvsize <= 0) {  // client ctrl-c
             break;
         }
         if (recvbuf[0] == '\r' || recvbuf[0] == '\n') {
             continue;
         }
-        if (recvsize > 1023) {
-            recvsize = 1023;
+        if (recvsize > CMD_BUF_LEN - 1) {
+            recvsize = CMD_BUF_LEN - 1;
         }
         recvbuf[recvsize] = '\0';
         printf("<-- %s", recvbuf);
+        cmdline = NULL;
+        if (trace_enabled()) {
+            cmdline = arena_alloc(&session->arena, recvsize + 1);
+            if (cmdline != NULL) {
+                memcpy(cmdline, recvbuf, recvsize + 1);
+            }
+        }
+        uint64_t start_us = trace_now_us();
 
         // Parse command string
         cmdstr = trimstr(strtok_r(recvbuf, " ", &saveptr));
@@ -59,16 +102,27 @@ void *handle_session(void *session_data) {
         }
 
         // Execute command
-        if (execute_cmd(to_cmd(cmdstr), argc, args, session)) {
+        int quit = execute_cmd(to_cmd(cmdstr), argc, args, session);
+        if (cmdline != NULL) {
+            trace_command(session, cmdline, start_us);
+        }
+        if (quit) {
             break;
         }
     }
 
     // End session
+    tls_close(session->tls);
+    session->tls = NULL;
     close(session->clientfd);
     close_connection(&session->data_connection);
+    strpool_release(session->cwd);
+    session->cwd = NULL;
+    arena_free(&session->arena);
+    trace_write(session->trace_id, TRACE_CLOSE, trace_now_us(), 0, NULL, 0);
     printf("FTP session closed (disconnect).\r\n");
-    session->state = STATE_EXITED;
+    // Publishes the teardown above to the shard that claims the slot next
+    __atomic_store_n(&session->state, STATE_EXITED, __ATOMIC_RELEASE);
     return NULL;
 }
 
@@ -82,7 +136,8 @@ void *handle_session(void *session_data) {
  * @return 1 if user session should be closed; else 0
  */
 int execute_cmd(cmd_t cmd, int argc, char *args[], client_session_t *session) {
-    if (cmd != CMD_USER && cmd != CMD_PASS && cmd != CMD_QUIT &&
+    if (cmd != CMD_USER && cmd != CMD_PASS && cmd != CMD_QUIT && cmd != CMD_FEAT &&
+        cmd != CMD_AUTH && cmd != CMD_PBSZ && cmd != CMD_PROT &&
         session->state == STATE_AWAITING_USER) {
         dprintf(session->clientfd, "530 Please login with USER.\r\n");
         return 0;
@@ -114,12 +169,30 @@ int execute_cmd(cmd_t cmd, int argc, char *args[], client_session_t *session) {
             return handle_retr(session, argc, args);
         case (CMD_PORT):
             return handle_port(session, argc, args);
+        case (CMD_EPRT):
+            return handle_eprt(session, argc, args);
         case (CMD_PASV):
             return handle_pasv(session, argc);
         case (CMD_LIST):
             return handle_nlst(session, argc);
         case (CMD_NLST):
             return handle_nlst(session, argc);
+        case (CMD_SITE):
+            return handle_site(session, argc, args);
+        case (CMD_FEAT):
+            return handle_feat(session, argc);
+        case (CMD_SIZE):
+            return handle_size(session, argc, args);
+        case (CMD_MDTM):
+            return handle_mdtm(session, argc, args);
+        case (CMD_MLST):
+            return handle_mlst(session, argc, args);
+        case (CMD_AUTH):
+            return handle_auth(session, argc, args);
+        case (CMD_PBSZ):
+            return handle_pbsz(session, argc, args);
+        case (CMD_PROT):
+            return handle_prot(session, argc, args);
         default:
             dprintf(session->clientfd, "500 Unknown command.\r\n");
             return 0;
@@ -150,7 +223,14 @@ int handle_user(client_session_t *session, int argc, char *args[]) {
     }
 
     // Set current working directory for client
-    strcpy(session->cwd, root_directory);
+    const char *cwd = strpool_intern(root_directory);
+    if (cwd == NULL) {
+        session->state = STATE_AWAITING_USER;
+        dprintf(session->clientfd, "421 Out of memory, try again later.\r\n");
+        return 0;
+    }
+    strpool_release(session->cwd);
+    session->cwd = cwd;
     session->state = STATE_AWAITING_PASS;
     dprintf(session->clientfd, "331 Please specify the password.\r\n");
     return 0;
@@ -216,20 +296,26 @@ int handle_cwd(client_session_t *session, int argc, char *args[]) {
         dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
         return 0;
     }
-    char dirpath[PATH_LEN];
-    if (to_absolute_path(args[0], session->cwd, dirpath) == 0) {
-        dprintf(session->clientfd, "550 Failed to change directory.\r\n");
+    path_lookup_t *lookup = lookup_path(session, args[0], LOOKUP_DIR);
+    if (lookup == NULL) {
         return 0;
     }
-    DIR *dir = opendir(dirpath);
-    if (dir == NULL) {
+    if (!lookup->allowed) {
+        dprintf(session->clientfd, "550 Failed to change directory.\r\n");
+    } else if (!lookup->found) {
         dprintf(session->clientfd, "550 No such directory.\r\n");
-        return 0;
+    } else {
+        const char *cwd = strpool_intern(lookup->path);
+        if (cwd == NULL) {
+            dprintf(session->clientfd, "451 Out of memory, directory not changed.\r\n");
+        } else {
+            strpool_release(session->cwd);
+            session->cwd = cwd;
+            printf("CWD %s 250\r\n", session->cwd);
+            dprintf(session->clientfd, "250 Working directory changed.\r\n");
+        }
     }
-    closedir(dir);
-    strcpy(session->cwd, dirpath);
-    printf("CWD %s 250\r\n", session->cwd);
-    dprintf(session->clientfd, "250 Working directory changed.\r\n");
+    free_lookup(lookup);
     return 0;
 }
 
@@ -251,9 +337,22 @@ int handle_cdup(client_session_t *session, int argc) {
     }
 
     // Set last occurrance of '/' to '\0'
-    char *end = session->cwd + strlen(session->cwd) - 1;
+    char *parent = arena_alloc(&session->arena, strlen(session->cwd) + 1);
+    if (parent == NULL) {
+        dprintf(session->clientfd, "451 Out of memory, directory not changed.\r\n");
+        return 0;
+    }
+    strcpy(parent, session->cwd);
+    char *end = parent + strlen(parent) - 1;
     while ((unsigned char)*end != '/') end--;
     *end = '\0';
+    const char *cwd = strpool_intern(parent);
+    if (cwd == NULL) {
+        dprintf(session->clientfd, "451 Out of memory, directory not changed.\r\n");
+        return 0;
+    }
+    strpool_release(session->cwd);
+    session->cwd = cwd;
 
     printf("CDUP 250, CWD=%s\r\n", session->cwd);
     dprintf(session->clientfd, "250 Working directory changed.\r\n");
@@ -276,8 +375,10 @@ int handle_type(client_session_t *session, int argc, char *args[]) {
 
     char *type = args[0];
     if (strcasecmp(type, "A") == 0) {
+        session->ascii_type = 1;
         dprintf(session->clientfd, "200 Set to ASCII type.\r\n");
     } else if (strcasecmp(type, "I") == 0) {
+        session->ascii_type = 0;
         dprintf(session->clientfd, "200 Set to Image type.\r\n");
     } else {
         dprintf(session->clientfd,
@@ -350,58 +451,57 @@ int handle_retr(client_session_t *session, int argc, char *args[]) {
     }
 
     connection_t *connection = &session->data_connection;
-    if (!connection->awaiting_client && connection->clientfd == -1) {
-        dprintf(session->clientfd, "425 Use PASV first.\r\n");
+    if (!await_data_connection(session)) {
         return 0;
     }
-    // if (connection->awaiting_client) {
-    //     dprintf(session->clientfd,
-    //             "425 Data connection has not been established.\r\n");
-    //     return 0;
-    // }
-    pthread_join(connection->accept_client_t, NULL);
 
-    char filepath[PATH_LEN];
-    if (to_absolute_path(args[0], session->cwd, filepath) == 0) {
+    path_lookup_t *lookup = lookup_path(session, args[0], LOOKUP_FILE);
+    if (lookup == NULL) {
+        return 0;
+    }
+    if (!lookup->allowed) {
         dprintf(session->clientfd, "550 File path not allowed.\r\n");
+        free_lookup(lookup);
         return 0;
     }
-    FILE *file = fopen(filepath, "r");
-    if (file == NULL) {
+    if (!lookup->found) {
         dprintf(session->clientfd, "550 File does not exist.\r\n");
+        free_lookup(lookup);
         return 0;
     }
+    char *filepath = lookup->path;
 
     dprintf(session->clientfd, "150 Opening data connection for %s.\r\n", filepath);
-    char buffer[1024];
-    size_t totalbytes = 0;
-    size_t bytesread;
-    size_t bufoffset;
-    size_t byteswrote;
-    while ((bytesread = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        bufoffset = 0;
-        while (bufoffset < bytesread) {
-            byteswrote = write(
-                connection->clientfd,
-                buffer + bufoffset,
-                bytesread - bufoffset
-            );
-            if (byteswrote <= 0) {
-                dprintf(session->clientfd, "550 Could not send file.\r\n");
-                close_connection(connection);
-                return 0;
-            }
-            bufoffset += byteswrote;
-        }
-        totalbytes += bytesread;
+    if (!secure_data_connection(session)) {
+        storage->close(&lookup->file);
+        free_lookup(lookup);
+        return 0;
+    }
+    off_t totalbytes = storage->send(connection->clientfd, &lookup->file, filepath,
+                                     lookup->st.st_size, session->ascii_type);
+    storage->close(&lookup->file);
+    if (totalbytes == -1) {
+        dprintf(session->clientfd, "451 Could not send file.\r\n");
+        close_connection(connection);
+        free_lookup(lookup);
+        return 0;
+    }
+    // ASCII transfers send more bytes than the file holds, so only a
+    // binary transfer can be checked for truncation
+    if (!session->ascii_type && totalbytes < lookup->st.st_size) {
+        printf("RETR %s truncated after %llu bytes.\r\n", filepath, (unsigned long long)totalbytes);
+        dprintf(session->clientfd, "451 Transfer aborted: file changed while being sent.\r\n");
+        close_connection(connection);
+        free_lookup(lookup);
+        return 0;
     }
 
-    fclose(file);
-    file = NULL;
-    printf("RETR %s completed with %u bytes sent.\r\n",
-            filepath, (unsigned) totalbytes);
+    printf("RETR %s completed with %llu bytes sent.\r\n",
+            filepath, (unsigned long long) totalbytes);
+    trace_write(session->trace_id, TRACE_TRANSFER, trace_now_us(), totalbytes, NULL, 0);
     dprintf(session->clientfd, "226 Transfer complete.\r\n");
     close_connection(connection);
+    free_lookup(lookup);
     return 0;
 }
 
@@ -422,7 +522,10 @@ int handle_pasv(client_session_t *session, int argc) {
     if (connection->awaiting_client || connection->clientfd != -1) {
         close_connection(connection);
     }
-    open_passive_port(session);
+    if (!open_passive_port(session)) {
+        dprintf(session->clientfd, "425 Could not open data connection.\r\n");
+        return 0;
+    }
     int port = get_socket_port(connection->passivefd);
     dprintf(session->clientfd,
             "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\r\n",
@@ -445,27 +548,446 @@ int handle_nlst(client_session_t *session, int argc) {
     }
 
     connection_t *connection = &session->data_connection;
-    if (!connection->awaiting_client && connection->clientfd == -1) {
-        dprintf(session->clientfd, "425 Use PASV first.\r\n");
+    if (!await_data_connection(session)) {
         return 0;
     }
 
-    // if (connection->awaiting_client) {
-    //     dprintf(session->clientfd, "425 Data connection has not been established.\r\n");
-    //     return 0;
-    // }
-    pthread_join(connection->accept_client_t, NULL);
+    dir_listing_t *listing = list_dir(session);
+    if (listing == NULL) {
+        close_connection(connection);
+        return 0;
+    }
+    if (listing->count == -1) {
+        dprintf(session->clientfd, "451 Could not read directory.\r\n");
+        release_listing(listing);
+        close_connection(connection);
+        return 0;
+    }
 
     dprintf(session->clientfd, "150 Here comes the directory listing.\r\n");
-    listFiles(connection->clientfd, session->cwd);
+    if (!secure_data_connection(session)) {
+        release_listing(listing);
+        return 0;
+    }
+    off_t size = lseek(listing->fd, 0, SEEK_END);
+    off_t sent = size == -1 ? -1 : send_file_range(connection->clientfd, listing->fd, 0, size);
+    release_listing(listing);
+    if (sent != size) {
+        dprintf(session->clientfd, "426 Connection closed; transfer aborted.\r\n");
+        close_connection(connection);
+        return 0;
+    }
     char msg[] = "226 Directory send OK.\r\n";
-    send(session->clientfd, msg, sizeof(msg), MSG_NOSIGNAL);
+    send(session->clientfd, msg, sizeof(msg) - 1, MSG_NOSIGNAL);
+    close_connection(connection);
+    return 0;
+}
+
+/**
+ * Lists supported extensions to the base FTP commands
+ *
+ * @param session
+ * @param argc
+ * @return 0
+ */
+int handle_feat(client_session_t *session, int argc) {
+    if (argc != 0) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    dprintf(session->clientfd, "211-Features:\r\n");
+    dprintf(session->clientfd, " MDTM\r\n");
+    dprintf(session->clientfd, " MLST type*;size*;modify*;UNIX.mode*;\r\n");
+    dprintf(session->clientfd, " SIZE\r\n");
+    if (tls_enabled()) {
+        dprintf(session->clientfd, " AUTH TLS\r\n");
+        dprintf(session->clientfd, " PBSZ\r\n");
+        dprintf(session->clientfd, " PROT\r\n");
+    }
+    dprintf(session->clientfd, "211 End\r\n");
+    return 0;
+}
+
+/**
+ * Sends size in bytes of regular file args[0]
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 0
+ */
+int handle_size(client_session_t *session, int argc, char *args[]) {
+    if (argc != 1) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    path_lookup_t *lookup = lookup_path(session, args[0], LOOKUP_STAT);
+    if (lookup == NULL) {
+        return 0;
+    }
+    if (!lookup->allowed) {
+        dprintf(session->clientfd, "550 File path not allowed.\r\n");
+    } else if (!lookup->found || !S_ISREG(lookup->st.st_mode)) {
+        dprintf(session->clientfd, "550 Could not get file size.\r\n");
+    } else {
+        dprintf(session->clientfd, "213 %lld\r\n", (long long)lookup->st.st_size);
+    }
+    free_lookup(lookup);
+    return 0;
+}
+
+/**
+ * Sends last modification time of args[0] in UTC
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 0
+ */
+int handle_mdtm(client_session_t *session, int argc, char *args[]) {
+    if (argc != 1) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    path_lookup_t *lookup = lookup_path(session, args[0], LOOKUP_STAT);
+    if (lookup == NULL) {
+        return 0;
+    }
+    if (!lookup->allowed) {
+        dprintf(session->clientfd, "550 File path not allowed.\r\n");
+    } else if (!lookup->found) {
+        dprintf(session->clientfd, "550 Could not get file modification time.\r\n");
+    } else {
+        char *timestamp = arena_alloc(&session->arena, TIMESTAMP_LEN);
+        if (timestamp == NULL) {
+            dprintf(session->clientfd, "451 Out of memory.\r\n");
+            free_lookup(lookup);
+            return 0;
+        }
+        format_timestamp(lookup->st.st_mtime, timestamp);
+        dprintf(session->clientfd, "213 %s\r\n", timestamp);
+    }
+    free_lookup(lookup);
+    return 0;
+}
+
+/**
+ * Sends machine-readable facts of args[0], or of CWD if omitted, on the
+ * control connection
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 0
+ */
+int handle_mlst(client_session_t *session, int argc, char *args[]) {
+    if (argc > 1) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    path_lookup_t *lookup = lookup_path(session, argc == 0 ? "." : args[0], LOOKUP_STAT);
+    if (lookup == NULL) {
+        return 0;
+    }
+    if (!lookup->allowed) {
+        dprintf(session->clientfd, "550 File path not allowed.\r\n");
+    } else if (!lookup->found) {
+        dprintf(session->clientfd, "550 No such file or directory.\r\n");
+    } else {
+        char *timestamp = arena_alloc(&session->arena, TIMESTAMP_LEN);
+        if (timestamp == NULL) {
+            dprintf(session->clientfd, "451 Out of memory.\r\n");
+            free_lookup(lookup);
+            return 0;
+        }
+        format_timestamp(lookup->st.st_mtime, timestamp);
+        const char *virtual_path = to_virtual_path(lookup->path);
+        dprintf(session->clientfd, "250-Listing %s\r\n", virtual_path);
+        dprintf(session->clientfd, " type=%s;size=%lld;modify=%s;UNIX.mode=%04o; %s\r\n",
+                S_ISDIR(lookup->st.st_mode) ? "dir" : S_ISREG(lookup->st.st_mode) ? "file" : "OS.unix=other",
+                (long long)lookup->st.st_size, timestamp,
+                (unsigned)(lookup->st.st_mode & 07777), virtual_path);
+        dprintf(session->clientfd, "250 End.\r\n");
+    }
+    free_lookup(lookup);
+    return 0;
+}
+
+/**
+ * Upgrades the control connection to TLS offloaded to the kernel
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 1 if the handshake failed and the session should be closed; else 0
+ */
+int handle_auth(client_session_t *session, int argc, char *args[]) {
+    if (argc != 1) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    if (strcasecmp(args[0], "TLS") != 0 && strcasecmp(args[0], "SSL") != 0) {
+        dprintf(session->clientfd, "504 Unsupported mechanism. Only TLS is allowed.\r\n");
+        return 0;
+    }
+    if (!tls_enabled()) {
+        dprintf(session->clientfd, "431 TLS is not available.\r\n");
+        return 0;
+    }
+    if (session->tls != NULL) {
+        dprintf(session->clientfd, "503 Already using TLS.\r\n");
+        return 0;
+    }
+    dprintf(session->clientfd, "234 Proceed with negotiation.\r\n");
+    session->tls = tls_accept(session->clientfd, 1);
+    if (session->tls == NULL) {
+        printf("TLS negotiation failed.\r\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Accepts protection buffer size 0, the only size valid for TLS
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 0
+ */
+int handle_pbsz(client_session_t *session, int argc, char *args[]) {
+    if (argc != 1) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    if (session->tls == NULL) {
+        dprintf(session->clientfd, "503 Use AUTH TLS first.\r\n");
+        return 0;
+    }
+    session->pbsz_set = 1;
+    dprintf(session->clientfd, "200 PBSZ=0\r\n");
+    return 0;
+}
+
+/**
+ * Sets data channel protection to private (P) or clear (C)
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 0
+ */
+int handle_prot(client_session_t *session, int argc, char *args[]) {
+    if (argc != 1) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    if (!session->pbsz_set) {
+        dprintf(session->clientfd, "503 Use PBSZ first.\r\n");
+        return 0;
+    }
+    if (strcasecmp(args[0], "P") == 0) {
+        session->protect_data = 1;
+        dprintf(session->clientfd, "200 Data protection level set to P.\r\n");
+    } else if (strcasecmp(args[0], "C") == 0) {
+        session->protect_data = 0;
+        dprintf(session->clientfd, "200 Data protection level set to C.\r\n");
+    } else {
+        dprintf(session->clientfd, "504 Unsupported protection level. Only P and C are allowed.\r\n");
+    }
+    return 0;
+}
+
+/**
+ * Dispatches SITE subcommand given in args[0]
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 0
+ */
+int handle_site(client_session_t *session, int argc, char *args[]) {
+    if (argc == 0) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    if (strcasecmp(args[0], "TAR") == 0) {
+        return handle_site_tar(session, argc - 1, args + 1);
+    }
+    if (strcasecmp(args[0], "STATS") == 0) {
+        return handle_site_stats(session, argc - 1);
+    }
+    if (strcasecmp(args[0], "FIND") == 0) {
+        return handle_site_find(session, argc - 1, args + 1);
+    }
+    dprintf(session->clientfd, "500 Unknown SITE command.\r\n");
+    return 0;
+}
+
+/**
+ * Streams a tar archive of directory args[0] (CWD if omitted) to DTP client fd
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 0
+ */
+int handle_site_tar(client_session_t *session, int argc, char *args[]) {
+    if (argc > 1) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    if (storage->send_tar == NULL) {
+        dprintf(session->clientfd, "504 SITE TAR not supported by %s storage.\r\n", storage->name);
+        return 0;
+    }
+
+    connection_t *connection = &session->data_connection;
+    if (!await_data_connection(session)) {
+        return 0;
+    }
+
+    path_lookup_t *lookup = lookup_path(session, argc == 0 ? "." : args[0], LOOKUP_DIR);
+    if (lookup == NULL) {
+        return 0;
+    }
+    if (!lookup->allowed || !lookup->found) {
+        dprintf(session->clientfd, lookup->allowed ? "550 No such directory.\r\n"
+                                                   : "550 Directory path not allowed.\r\n");
+        free_lookup(lookup);
+        return 0;
+    }
+    char *dirpath = lookup->path;
+
+    // Archive entries are rooted at the directory name, or unprefixed for root
+    char *name = "";
+    if (strcmp(dirpath, root_directory) != 0) {
+        name = strrchr(dirpath, '/') + 1;
+    }
+
+    dprintf(session->clientfd, "150 Opening data connection for %s.tar.\r\n", dirpath);
+    if (!secure_data_connection(session)) {
+        free_lookup(lookup);
+        return 0;
+    }
+    int count = storage->send_tar(connection->clientfd, dirpath, name);
+    if (count == -1) {
+        dprintf(session->clientfd, "451 Could not send archive.\r\n");
+    } else {
+        printf("SITE TAR %s completed with %d entries sent.\r\n", dirpath, count);
+        dprintf(session->clientfd, "226 Transfer complete.\r\n");
+    }
+    close_connection(connection);
+    free_lookup(lookup);
+    return 0;
+}
+
+/**
+ * Streams paths below CWD matching glob args[0] to DTP client fd, looked up
+ * in the name index
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 0
+ */
+int handle_site_find(client_session_t *session, int argc, char *args[]) {
+    if (argc != 1) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    nameindex_state_t index_state = nameindex_state();
+    if (index_state == INDEX_OFF) {
+        dprintf(session->clientfd, "504 SITE FIND not supported by %s storage.\r\n", storage->name);
+        return 0;
+    }
+    if (index_state == INDEX_BUILDING) {
+        dprintf(session->clientfd, "450 File index is still being built.\r\n");
+        return 0;
+    }
+
+    connection_t *connection = &session->data_connection;
+    if (!await_data_connection(session)) {
+        return 0;
+    }
+
+    dprintf(session->clientfd, "150 Here comes the file list.\r\n");
+    if (!secure_data_connection(session)) {
+        return 0;
+    }
+    int count = nameindex_find(connection->clientfd, &session->cwd[strlen(root_directory)], args[0]);
+    if (count == -1) {
+        dprintf(session->clientfd, "451 Could not send file list.\r\n");
+    } else {
+        dprintf(session->clientfd, "226 Search complete, %d matches.\r\n", count);
+    }
     close_connection(connection);
     return 0;
 }
 
 /**
- * Binds socket to data port
+ * Sends server statistics to client as a multiline 211 reply
+ *
+ * @param session
+ * @param argc
+ * @return 0
+ */
+int handle_site_stats(client_session_t *session, int argc) {
+    if (argc != 0) {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    iopool_stats_t io_stats;
+    iopool_get_stats(&io_stats);
+    strpool_stats_t cwd_stats;
+    strpool_get_stats(&cwd_stats);
+    int num_sessions = 0;
+    for (int i = 0; i < max_sessions; i++) {
+        session_state_t state = __atomic_load_n(&sessions[i].state, __ATOMIC_RELAXED);
+        num_sessions += state != STATE_OPEN && state != STATE_EXITED;
+    }
+    dprintf(session->clientfd, "211-Server statistics:\r\n");
+    dprintf(session->clientfd, " sessions %d/%d\r\n", num_sessions, max_sessions);
+    dprintf(session->clientfd, " session_bytes %zu\r\n", session_footprint());
+    dprintf(session->clientfd, " cwd_strings %zu\r\n", cwd_stats.num_strings);
+    dprintf(session->clientfd, " cwd_refs %zu\r\n", cwd_stats.num_refs);
+    dprintf(session->clientfd, " cwd_bytes %zu\r\n", cwd_stats.bytes);
+    dprintf(session->clientfd, " io_workers %d\r\n", io_stats.num_workers);
+    dprintf(session->clientfd, " io_busy_workers %d\r\n", io_stats.busy_workers);
+    dprintf(session->clientfd, " io_queue_depth %d\r\n", io_stats.queue_depth);
+    dprintf(session->clientfd, " io_max_queue_depth %d\r\n", io_stats.max_queue_depth);
+    dprintf(session->clientfd, " io_submitted %lu\r\n", io_stats.submitted);
+    dprintf(session->clientfd, " io_completed %lu\r\n", io_stats.completed);
+    dprintf(session->clientfd, " io_stolen %lu\r\n", io_stats.stolen);
+    dprintf(session->clientfd, " io_abandoned %lu\r\n", io_stats.abandoned);
+    statcache_stats_t stat_stats;
+    statcache_get_stats(&stat_stats);
+    dprintf(session->clientfd, " statcache_entries %zu\r\n", stat_stats.entries);
+    dprintf(session->clientfd, " statcache_hits %lu\r\n", stat_stats.hits);
+    dprintf(session->clientfd, " statcache_misses %lu\r\n", stat_stats.misses);
+    dprintf(session->clientfd, " statcache_invalidations %lu\r\n", stat_stats.invalidations);
+    coalesce_stats_t coalesce_stats;
+    coalesce_get_stats(&coalesce_stats);
+    dprintf(session->clientfd, " coalesce_groups %d\r\n", coalesce_stats.groups);
+    dprintf(session->clientfd, " coalesce_subscribers %d\r\n", coalesce_stats.subscribers);
+    dprintf(session->clientfd, " coalesce_retained_bytes %zu\r\n", coalesce_stats.retained_bytes);
+    dprintf(session->clientfd, " coalesce_chunk_reads %lu\r\n", coalesce_stats.chunk_reads);
+    dprintf(session->clientfd, " coalesce_shared_sends %lu\r\n", coalesce_stats.shared_sends);
+    dprintf(session->clientfd, " coalesce_private_reads %lu\r\n", coalesce_stats.private_reads);
+    nameindex_stats_t index_stats;
+    nameindex_get_stats(&index_stats);
+    dprintf(session->clientfd, " index_entries %zu\r\n", index_stats.entries);
+    dprintf(session->clientfd, " index_bytes %zu\r\n", index_stats.bytes);
+    dprintf(session->clientfd, " index_updates %lu\r\n", index_stats.updates);
+    dprintf(session->clientfd, " index_rebuilds %lu\r\n", index_stats.rebuilds);
+    dprintf(session->clientfd, " index_unwatched %lu\r\n", index_stats.unwatched);
+    dprintf(session->clientfd, "211 End.\r\n");
+    return 0;
+}
+
+/**
+ * Starts an active mode data connection to the address in args[0], given as
+ * h1,h2,h3,h4,p1,p2
  *
  * @param session
  * @param argc
@@ -490,40 +1012,152 @@ int handle_port(client_session_t *session, int argc, char *args[]) {
         dprintf(session->clientfd, "500 Illegal PORT command.\r\n");
         return 0;
     }
-    char ipaddr[256];
-    strcpy(ipaddr, tokens[0]);
-    for (int i = 1; i < 4; i++) {
-        strcat(ipaddr, ".");
-        strcat(ipaddr, tokens[i]);
-    }
-    int port = (atoi(tokens[4]) << 8) + atoi(tokens[5]);
-    int clientfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (clientfd < 0) {
-        printf("Socket creation error\n");
+    char ipaddr[INET_ADDRSTRLEN];
+    int len = snprintf(ipaddr, sizeof(ipaddr), "%s.%s.%s.%s", tokens[0], tokens[1], tokens[2], tokens[3]);
+    if (len < 0 || len >= (int)sizeof(ipaddr)) {
+        dprintf(session->clientfd, "500 Illegal PORT command.\r\n");
         return 0;
     }
+    int port = (atoi(tokens[4]) << 8) + atoi(tokens[5]);
 
     struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     sin.sin_port = htons(port);
-    if (inet_pton(AF_INET, ipaddr, &sin.sin_addr) <= 0) {
-        printf("Invalid IP address\n");
+    if (port <= 0 || port > MAX_PORT || inet_pton(AF_INET, ipaddr, &sin.sin_addr) <= 0) {
+        dprintf(session->clientfd, "500 Illegal PORT command.\r\n");
         return 0;
     }
+    if (open_active_connection(session, (struct sockaddr *)&sin, sizeof(sin))) {
+        dprintf(session->clientfd, "200 PORT command successful.\r\n");
+    }
+    return 0;
+}
 
-    int passivefd = connect(clientfd, (struct sockaddr *)&sin, sizeof(sin));
-    if (passivefd < 0) {
-        printf("Connect failed\n");
+/**
+ * Starts an active mode data connection to the address in args[0], given as
+ * <d>af<d>address<d>port<d> (RFC 2428) with af 1 for IPv4 or 2 for IPv6
+ *
+ * @param session
+ * @param argc
+ * @param args
+ * @return 0
+ */
+int handle_eprt(client_session_t *session, int argc, char *args[]) {
+    if (argc != 1 || args[0][0] == '\0') {
+        dprintf(session->clientfd, "501 Incorrect number of parameters.\r\n");
+        return 0;
+    }
+    char delim[2] = {args[0][0], '\0'};
+    char *saveptr = NULL;
+    char *af = strtok_r(args[0], delim, &saveptr);
+    char *ipaddr = strtok_r(NULL, delim, &saveptr);
+    char *portstr = strtok_r(NULL, delim, &saveptr);
+    int port = portstr != NULL ? atoi(portstr) : 0;
+    if (af == NULL || ipaddr == NULL || port <= 0 || port > MAX_PORT) {
+        dprintf(session->clientfd, "501 Illegal EPRT command.\r\n");
         return 0;
     }
 
-    session->data_connection.passivefd = passivefd;
-    session->data_connection.clientfd = clientfd;
-    session->data_connection.awaiting_client = 0;
-    dprintf(session->clientfd, "200 Connect successful.\r\n");
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    memset(&addr, 0, sizeof(addr));
+    if (strcmp(af, "1") == 0) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        addrlen = sizeof(*sin);
+        if (inet_pton(AF_INET, ipaddr, &sin->sin_addr) <= 0) {
+            dprintf(session->clientfd, "501 Illegal EPRT command.\r\n");
+            return 0;
+        }
+    } else if (strcmp(af, "2") == 0) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        addrlen = sizeof(*sin6);
+        if (inet_pton(AF_INET6, ipaddr, &sin6->sin6_addr) <= 0) {
+            dprintf(session->clientfd, "501 Illegal EPRT command.\r\n");
+            return 0;
+        }
+    } else {
+        dprintf(session->clientfd, "522 Network protocol not supported, use (1,2)\r\n");
+        return 0;
+    }
+    if (open_active_connection(session, (struct sockaddr *)&addr, addrlen)) {
+        dprintf(session->clientfd, "200 EPRT command successful.\r\n");
+    }
     return 0;
 }
 
+/**
+ * Starts a non-blocking connect to a client data port. The connect is
+ * completed by connect_data_client, so a client that never answers holds
+ * up the next transfer command by at most connect_timeout_ms rather than
+ * the kernel's SYN retry period.
+ *
+ * @param session
+ * @param addr client data port address
+ * @param addrlen length of addr
+ * @return 1 if the connection was started; else 0 after replying 425
+ */
+int open_active_connection(client_session_t *session, struct sockaddr *addr, socklen_t addrlen) {
+    connection_t *connection = &session->data_connection;
+    close_connection(connection);
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        dprintf(session->clientfd, "425 Could not open data connection.\r\n");
+        return 0;
+    }
+    if (connect(fd, addr, addrlen) == 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        connection->clientfd = fd;
+        return 1;
+    }
+    if (errno != EINPROGRESS) {
+        close(fd);
+        dprintf(session->clientfd, "425 Could not open data connection.\r\n");
+        return 0;
+    }
+    // Connecting socket is held as passivefd until connect_data_client
+    // completes it, so close_connection can cancel the attempt
+    connection->passivefd = fd;
+    connection->awaiting_client = 1;
+    if (start_thread(&connection->accept_client_t, connect_data_client, (void *)session,
+                     DTP_STACK_SIZE) != 0) {
+        connection->awaiting_client = 0;
+        close_connection(connection);
+        dprintf(session->clientfd, "425 Could not open data connection.\r\n");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Waits up to connect_timeout_ms for the connect started by
+ * open_active_connection. On success the socket becomes the data connection
+ * clientfd; on failure clientfd stays -1 and await_data_connection replies.
+ *
+ * @param session_data bytes representing client control session session
+ * @return NULL
+ */
+void *connect_data_client(void *session_data) {
+    client_session_t *session = session_data;
+    connection_t *connection = &session->data_connection;
+    int fd = connection->passivefd;
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (poll(&pfd, 1, connect_timeout_ms) <= 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    connection->clientfd = fd;
+    connection->passivefd = -1;
+    return NULL;
+}
+
 /**
  * Exposes a new port for a DTP connection for a given session session
  *
@@ -538,18 +1172,18 @@ int open_passive_port(client_session_t *session) {
     }
     connection->clientfd = -1;
     connection->awaiting_client = 1;
-    pthread_create(
-        &connection->accept_client_t,
-        NULL,
-        accept_data_client,
-        (void *)session
-    );
+    if (start_thread(&connection->accept_client_t, accept_data_client, (void *)session,
+                     DTP_STACK_SIZE) != 0) {
+        connection->awaiting_client = 0;
+        close_connection(connection);
+        return 0;
+    }
     return 1;
 }
 
 /**
  * Awaits DTP client to accept or times out if client does not connect
- * within DTP_TIMEOUT_SECONDS
+ * within DTP_TIMEOUT_SECONDS; await_data_connection reports failures
  *
  * @param session_data bytes representing client control session session
  * @return NULL
@@ -558,32 +1192,46 @@ void *accept_data_client(void *session_data) {
     client_session_t *session = session_data;
     connection_t *connection = &session->data_connection;
 
-    // https://linux.die.net/man/2/select
-    struct timeval tv;
-    fd_set readfds;
-    tv.tv_sec = DTP_TIMEOUT_SECONDS;
-    tv.tv_usec = 0;
-    FD_ZERO(&readfds);
-    FD_SET(connection->passivefd, &readfds);
-    if (select(connection->passivefd + 1, &readfds, NULL, NULL, &tv) == 0) {
-        dprintf(session->clientfd, "421 Timeout.\r\n");
-        close_connection(connection);
+    // poll rather than select: descriptors can exceed FD_SETSIZE
+    struct pollfd pfd = {.fd = connection->passivefd, .events = POLLIN};
+    if (poll(&pfd, 1, DTP_TIMEOUT_SECONDS * 1000) <= 0) {
         return NULL;
     }
 
     struct sockaddr_in sin;
     socklen_t addrlen = sizeof(sin);
-    connection->clientfd = accept(connection->passivefd, (struct sockaddr *) &sin, &addrlen);
-    if (connection->clientfd < 0) {
-        dprintf(session->clientfd, "425 Could not open data connection.\r\n");
-        close_connection(connection);
+    int clientfd = accept(connection->passivefd, (struct sockaddr *) &sin, &addrlen);
+    if (clientfd < 0) {
         return NULL;
     }
-
-    connection->awaiting_client = 0;
+    connection->clientfd = clientfd;
     return NULL;
 }
 
+/**
+ * Waits for the data connection started by PASV, PORT or EPRT
+ *
+ * @param session
+ * @return 1 if the data connection is open; else 0 after replying 425
+ */
+int await_data_connection(client_session_t *session) {
+    connection_t *connection = &session->data_connection;
+    if (!connection->awaiting_client && connection->clientfd == -1) {
+        dprintf(session->clientfd, "425 Use PORT or PASV first.\r\n");
+        return 0;
+    }
+    if (connection->awaiting_client) {
+        pthread_join(connection->accept_client_t, NULL);
+        connection->awaiting_client = 0;
+    }
+    if (connection->clientfd == -1) {
+        dprintf(session->clientfd, "425 Could not open data connection.\r\n");
+        close_connection(connection);
+        return 0;
+    }
+    return 1;
+}
+
 /**
  * Maps a given str to command type
  *
@@ -603,12 +1251,41 @@ cmd_t to_cmd(char *str) {
     return CMD_INVALID;
 }
 
+/**
+ * Starts TLS on the data connection if the client asked for PROT P. Clients
+ * start the handshake after the 150 reply, so this must follow it.
+ *
+ * @param session
+ * @return 1 if data connection is ready; else 0 after replying and closing it
+ */
+int secure_data_connection(client_session_t *session) {
+    connection_t *connection = &session->data_connection;
+    if (!session->protect_data) {
+        return 1;
+    }
+    connection->tls = tls_accept(connection->clientfd, 0);
+    if (connection->tls == NULL) {
+        dprintf(session->clientfd, "425 TLS negotiation on data connection failed.\r\n");
+        close_connection(connection);
+        return 0;
+    }
+    return 1;
+}
+
 /**
  * Close fds of connection and sets connection fields to empty values
  *
  * @param connection
  */
 void close_connection(connection_t *connection) {
+    // Stop the accept or connect thread before closing the fds it uses
+    if (connection->awaiting_client) {
+        pthread_cancel(connection->accept_client_t);
+        pthread_join(connection->accept_client_t, NULL);
+    }
+    connection->awaiting_client = 0;
+    tls_close(connection->tls);
+    connection->tls = NULL;
     if (connection->clientfd != -1) {
         close(connection->clientfd);
         connection->clientfd = -1;
@@ -617,11 +1294,145 @@ void close_connection(connection_t *connection) {
         close(connection->passivefd);
         connection->passivefd = -1;
     }
-    if (connection->awaiting_client) {
-        pthread_cancel(connection->accept_client_t);
-        pthread_join(connection->accept_client_t, NULL);
+}
+
+/**
+ * Resolves relpath against the session CWD and checks it on the IO pool,
+ * so slow storage holds up a pool worker rather than the session. Sends
+ * 450 to the client if the lookup does not finish within IO_TIMEOUT_MS.
+ *
+ * @param session
+ * @param relpath path requested by client
+ * @param type whether relpath should be a directory, a readable file or
+ *             any existing path
+ * @return lookup result that should be freed by caller; NULL on timeout or
+ *         allocation failure, after a reply has been sent
+ */
+path_lookup_t *lookup_path(client_session_t *session, char *relpath, lookup_type_t type) {
+    path_lookup_t *lookup = malloc(sizeof(path_lookup_t));
+    if (lookup == NULL) {
+        dprintf(session->clientfd, "451 Out of memory.\r\n");
+        return NULL;
     }
-    connection->awaiting_client = 0;
+    lookup->type = type;
+    strncpy(lookup->relpath, relpath, PATH_LEN - 1);
+    lookup->relpath[PATH_LEN - 1] = '\0';
+    lookup->cwd = strpool_acquire(session->cwd);
+    lookup->allowed = 0;
+    lookup->found = 0;
+    lookup->file.fd = -1;
+    if (iopool_run(run_lookup, release_lookup, lookup, IO_TIMEOUT_MS) == -1) {
+        dprintf(session->clientfd, "450 Filesystem busy, try again later.\r\n");
+        return NULL;
+    }
+    return lookup;
+}
+
+/**
+ * Performs the blocking filesystem calls of a path_lookup_t
+ *
+ * @param lookup_data path_lookup_t to fill in
+ */
+void run_lookup(void *lookup_data) {
+    path_lookup_t *lookup = lookup_data;
+    lookup->allowed = to_absolute_path(lookup->relpath, lookup->cwd, lookup->path);
+    if (!lookup->allowed) {
+        return;
+    }
+    if (storage->stat(lookup->path, &lookup->st) == -1) {
+        return;
+    }
+    switch (lookup->type) {
+        case (LOOKUP_DIR):
+            lookup->found = S_ISDIR(lookup->st.st_mode);
+            break;
+        case (LOOKUP_FILE):
+            if (!S_ISREG(lookup->st.st_mode)) {
+                break;
+            }
+            lookup->found = storage->open(lookup->path, &lookup->file, &lookup->st);
+            break;
+        default:
+            lookup->found = 1;
+            break;
+    }
+}
+
+/**
+ * Frees a path_lookup_t abandoned by its session
+ *
+ * @param lookup_data path_lookup_t to free
+ */
+void release_lookup(void *lookup_data) {
+    path_lookup_t *lookup = lookup_data;
+    if (lookup->file.fd != -1) {
+        storage->close(&lookup->file);
+    }
+    free_lookup(lookup);
+}
+
+/**
+ * Lists the session CWD into an anonymous file on the IO pool, so opendir
+ * and readdir on slow storage hold up a pool worker rather than the
+ * session. Sends 450 to the client if the listing does not finish within
+ * IO_TIMEOUT_MS.
+ *
+ * @param session
+ * @return listing that should be released by caller, with count -1 if the
+ *         directory could not be read; NULL on timeout or allocation
+ *         failure, after a reply has been sent
+ */
+dir_listing_t *list_dir(client_session_t *session) {
+    dir_listing_t *listing = malloc(sizeof(dir_listing_t));
+    if (listing == NULL) {
+        dprintf(session->clientfd, "451 Out of memory.\r\n");
+        return NULL;
+    }
+    listing->cwd = strpool_acquire(session->cwd);
+    listing->fd = -1;
+    listing->count = -1;
+    if (iopool_run(run_listing, release_listing, listing, IO_TIMEOUT_MS) == -1) {
+        dprintf(session->clientfd, "450 Filesystem busy, try again later.\r\n");
+        return NULL;
+    }
+    return listing;
+}
+
+/**
+ * Performs the blocking filesystem calls of a dir_listing_t
+ *
+ * @param listing_data dir_listing_t to fill in
+ */
+void run_listing(void *listing_data) {
+    dir_listing_t *listing = listing_data;
+    listing->fd = memfd_create("nlst", MFD_CLOEXEC);
+    if (listing->fd != -1) {
+        listing->count = storage->list(listing->fd, listing->cwd);
+    }
+}
+
+/**
+ * Closes and frees a dir_listing_t, also when abandoned by its session
+ *
+ * @param listing_data dir_listing_t to free
+ */
+void release_listing(void *listing_data) {
+    dir_listing_t *listing = listing_data;
+    if (listing->fd != -1) {
+        close(listing->fd);
+    }
+    strpool_release(listing->cwd);
+    free(listing);
+}
+
+/**
+ * Drops the CWD reference of lookup and frees it
+ *
+ * @param lookup
+ */
+void free_lookup(path_lookup_t *lookup) {
+    strpool_release(lookup->cwd);
+    free(lookup);
 }
 
 /**
@@ -632,7 +1443,7 @@ void close_connection(connection_t *connection) {
  * @param outpath return absolute path
  * @return 1 if path is accessible; else 0
  */
-int to_absolute_path(char *relpath, char cwd[], char outpath[]) {
+int to_absolute_path(char *relpath, const char *cwd, char outpath[]) {
     if (strstr(relpath, "./") != NULL || strstr(relpath, "../") != NULL ||
         strcmp(relpath, "..") == 0) {
         return 0;
@@ -651,10 +1462,80 @@ int to_absolute_path(char *relpath, char cwd[], char outpath[]) {
         strcat(absolute_path, relpath);
     }
     // Set canonicalized absolute pathname in outpath
-    realpath(absolute_path, outpath);
+    storage->canonicalize(absolute_path, outpath);
     return 1;
 }
 
+/**
+ * Formats time as a YYYYMMDDHHMMSS UTC timestamp
+ *
+ * @param time seconds since epoch
+ * @param outstr return timestamp of at least TIMESTAMP_LEN bytes
+ */
+void format_timestamp(time_t time, char outstr[]) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+    strftime(outstr, TIMESTAMP_LEN, "%Y%m%d%H%M%S", &tm);
+}
+
+/**
+ * Gets path as shown to clients, relative to root_directory
+ *
+ * @param path absolute path under root_directory
+ * @return path starting with '/'
+ */
+const char *to_virtual_path(const char *path) {
+    const char *virtual_path = path + strlen(root_directory);
+    return *virtual_path == '\0' ? "/" : virtual_path;
+}
+
+/**
+ * Records a command line and its latency in the trace. Line endings are
+ * stripped and PASS arguments are recorded as "*".
+ *
+ * @param session session that ran the command
+ * @param line command line as received
+ * @param start_us trace time when the command was received
+ */
+void trace_command(client_session_t *session, const char *line, uint64_t start_us) {
+    uint64_t latency_us = trace_now_us() - start_us;
+    size_t len = strcspn(line, "\r\n");
+    if (strncasecmp(line, "PASS ", 5) == 0) {
+        line = "PASS *";
+        len = 6;
+    }
+    trace_write(session->trace_id, TRACE_COMMAND, start_us, latency_us, line, len);
+}
+
+/**
+ * Starts a joinable thread with an explicit stack size instead of the
+ * default of several megabytes
+ *
+ * @param thread return thread id
+ * @param fn thread function
+ * @param arg argument to fn
+ * @param stack_size stack size in bytes
+ * @return 0 on success; else error number from pthread_create
+ */
+int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg, size_t stack_size) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    int status = pthread_create(thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    return status;
+}
+
+/**
+ * Bytes reserved for each logged in session, excluding the interned CWD
+ * shared with other sessions
+ *
+ * @return session struct, thread stack and arena size in bytes
+ */
+size_t session_footprint() {
+    return sizeof(client_session_t) + SESSION_STACK_SIZE + SESSION_ARENA_SIZE;
+}
+
 char *trimstr(char *str) {
     if (str == NULL) {
         return str;
@@ -3,19 +3,37 @@
 
 #include <pthread.h>
 
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "arena.h"
+#include "storage.h"
 #include "tcpserver.h"
+#include "tls.h"
 
 #define USER "anonymous"
 #define DTP_TIMEOUT_SECONDS 60
+#define DEFAULT_CONNECT_TIMEOUT_MS 10000
+#define IO_TIMEOUT_MS 5000
 #define PATH_LEN 1024
+#define CMD_BUF_LEN 1024
+#define SESSION_ARENA_SIZE 4096  // must fit the scratch buffers of any one command
+#define SESSION_STACK_SIZE (128 * 1024)
+#define DTP_STACK_SIZE (32 * 1024)
+#define CACHE_LINE_SIZE 64
+#define DEFAULT_MAX_SESSIONS 64
 #define MAX_NUM_ARGS 4
-#define NUM_CMDS 15
+#define NUM_CMDS 24
+#define TIMESTAMP_LEN 15
 
 typedef struct connection_s {
     int passivefd;
     int clientfd;
     int awaiting_client;
     pthread_t accept_client_t;  // cancel old awaiting connections
+    tls_conn_t *tls;            // set while PROT P transfer is in progress
 } connection_t;
 
 typedef enum {
@@ -26,12 +44,19 @@ typedef enum {
     STATE_EXITED
 } session_state_t;
 
-typedef struct client_session_s {
+// Slots are claimed by every shard; keep each on its own cache lines
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) client_session_s {
     int clientfd;
-    char cwd[PATH_LEN];
+    const char *cwd;  // interned in strpool
+    arena_t arena;    // scratch buffers, reset after each command
+    tls_conn_t *tls;  // set after AUTH TLS
+    int pbsz_set;
+    int protect_data;  // 1 after PROT P
+    int ascii_type;    // 1 after TYPE A
     connection_t data_connection;
     session_state_t state;
     pthread_t session_thread;
+    uint32_t trace_id;  // unique per accepted connection
 } client_session_t;
 
 typedef enum {
@@ -50,17 +75,54 @@ typedef enum {
     CMD_PASV,
     CMD_LIST,
     CMD_NLST,
+    CMD_SITE,
+    CMD_FEAT,
+    CMD_SIZE,
+    CMD_MDTM,
+    CMD_MLST,
+    CMD_AUTH,
+    CMD_PBSZ,
+    CMD_PROT,
+    CMD_EPRT,
     CMD_INVALID
 } cmd_t;
 
+typedef enum {
+    LOOKUP_DIR,
+    LOOKUP_FILE,
+    LOOKUP_STAT
+} lookup_type_t;
+
+// Path resolution request run on the IO pool
+typedef struct path_lookup_s {
+    lookup_type_t type;
+    char relpath[PATH_LEN];
+    const char *cwd;  // reference to interned session CWD
+    char path[PATH_LEN];
+    int allowed;  // 1 if relpath is accessible from cwd
+    int found;       // 1 if path exists and is of type
+    storage_file_t file;  // opened file for LOOKUP_FILE
+    struct stat st;  // metadata of path if found
+} path_lookup_t;
+
+// Directory listing run on the IO pool
+typedef struct dir_listing_s {
+    const char *cwd;  // reference to interned session CWD
+    int fd;           // anonymous file holding the listing
+    int count;        // number of names listed; -1 on failure
+} dir_listing_t;
+
 typedef struct cmd_map_s {
     char *cmd_str;
     cmd_t cmd;
 } cmd_map_t;
 
+extern client_session_t *sessions;
+extern int max_sessions;
 extern char *root_directory;
 extern int hostip_octets[4];
 extern cmd_map_t cmd_map[NUM_CMDS];
+extern int connect_timeout_ms;
 
 void *handle_session(void *clientfd);
 
@@ -77,17 +139,47 @@ int handle_mode(client_session_t *state, int argc, char *args[]);
 int handle_stru(client_session_t *state, int argc, char *args[]);
 int handle_retr(client_session_t *state, int argc, char *args[]);
 int handle_port(client_session_t *state, int argc, char *args[]);
+int handle_eprt(client_session_t *state, int argc, char *args[]);
 int handle_pasv(client_session_t *state, int argc);
 int handle_nlst(client_session_t *state, int argc);
+int handle_site(client_session_t *state, int argc, char *args[]);
+int handle_site_tar(client_session_t *state, int argc, char *args[]);
+int handle_site_stats(client_session_t *state, int argc);
+int handle_site_find(client_session_t *state, int argc, char *args[]);
+int handle_feat(client_session_t *state, int argc);
+int handle_size(client_session_t *state, int argc, char *args[]);
+int handle_mdtm(client_session_t *state, int argc, char *args[]);
+int handle_mlst(client_session_t *state, int argc, char *args[]);
+int handle_auth(client_session_t *state, int argc, char *args[]);
+int handle_pbsz(client_session_t *state, int argc, char *args[]);
+int handle_prot(client_session_t *state, int argc, char *args[]);
 
 // DTP connection handling
 int open_passive_port(client_session_t *state);
 void *accept_data_client(void *state);
+int open_active_connection(client_session_t *session, struct sockaddr *addr, socklen_t addrlen);
+void *connect_data_client(void *state);
+int await_data_connection(client_session_t *session);
+int secure_data_connection(client_session_t *session);
 void close_connection(connection_t *connection);
 
+// Filesystem access offloaded to the IO pool
+path_lookup_t *lookup_path(client_session_t *session, char *relpath, lookup_type_t type);
+void run_lookup(void *lookup);
+void release_lookup(void *lookup);
+void free_lookup(path_lookup_t *lookup);
+dir_listing_t *list_dir(client_session_t *session);
+void run_listing(void *listing);
+void release_listing(void *listing);
+
 // Helper functions
+int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg, size_t stack_size);
+size_t session_footprint();
+void format_timestamp(time_t time, char outstr[]);
+const char *to_virtual_path(const char *path);
+void trace_command(client_session_t *session, const char *line, uint64_t start_us);
 cmd_t to_cmd(char *str);
-int to_absolute_path(char *relpath, char cwd[], char outpath[]);
+int to_absolute_path(char *relpath, const char *cwd, char outpath[]);
 char *trimstr(char *str);
 int istrimchar(unsigned char chr);
 
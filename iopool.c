@@ -0,0 +1,391 @@
+/**
+ * @file iopool.c
+ * Work-stealing thread pool for blocking filesystem operations
+ *
+ * Each worker owns a job queue; jobs are submitted round-robin and a worker
+ * with an empty queue steals from the back of another worker's queue, so one
+ * worker stuck on slow storage does not hold up the jobs queued behind it.
+ * Workers can be split into groups pinned to disjoint CPUs, one per accept
+ * shard; a job is then queued to a worker of the group running on the
+ * submitting CPU, and idle workers steal within their group first.
+ * There is no pool-wide lock: each worker sleeps on its own condition
+ * variable, and a submitter wakes the queue's owner if it is idle, else
+ * one idle worker to steal the job.
+ *
+ * Public functions:
+ * - iopool_init
+ * - iopool_set_groups
+ * - iopool_run
+ * - iopool_get_stats
+ *
+ */
+
+#define _GNU_SOURCE
+#include "iopool.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct iopool_job_s {
+    iopool_fn_t fn;
+    iopool_fn_t release;
+    void *arg;
+    int done;
+    int abandoned;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct iopool_job_s *prev;
+    struct iopool_job_s *next;
+} iopool_job_t;
+
+typedef struct iopool_worker_s {
+    int id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  // signalled when a job is queued or to steal
+    int woken;
+    iopool_job_t *head;
+    iopool_job_t *tail;
+} iopool_worker_t;
+
+static iopool_worker_t workers[MAX_IO_WORKERS];
+static int num_workers;
+static unsigned int next_worker;
+
+// Worker w is in group w % num_groups; set once by iopool_set_groups
+static int num_groups = 1;
+static int *group_of_cpu;
+static int num_cpus;
+
+// Bit w is set while worker w is idle; MAX_IO_WORKERS fits in 64 bits
+static uint64_t idle_workers;
+
+// Updated with atomic operations
+static iopool_stats_t stats;
+
+/**
+ * Removes the job at the front of worker's queue if steal is 0;
+ * else removes the job at the back
+ *
+ * @return removed job; NULL if queue is empty
+ */
+static iopool_job_t *take_job(iopool_worker_t *worker, int steal) {
+    pthread_mutex_lock(&worker->lock);
+    iopool_job_t *job = steal ? worker->tail : worker->head;
+    if (job != NULL) {
+        __atomic_sub_fetch(&stats.queue_depth, 1, __ATOMIC_RELAXED);
+        if (job->prev != NULL) {
+            job->prev->next = job->next;
+        } else {
+            worker->head = job->next;
+        }
+        if (job->next != NULL) {
+            job->next->prev = job->prev;
+        } else {
+            worker->tail = job->prev;
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return job;
+}
+
+/**
+ * Takes a job from worker's own queue, or steals one from another worker
+ *
+ * @return job; NULL if all queues are empty
+ */
+static iopool_job_t *find_job(iopool_worker_t *worker) {
+    iopool_job_t *job = take_job(worker, 0);
+    // Steal from workers of the same group, then from any
+    int groups = __atomic_load_n(&num_groups, __ATOMIC_ACQUIRE);
+    for (int pass = 0; job == NULL && pass < 2; pass++) {
+        for (int i = 1; job == NULL && i < num_workers; i++) {
+            int victim = (worker->id + i) % num_workers;
+            if ((victim % groups == worker->id % groups) != (pass == 0)) {
+                continue;
+            }
+            job = take_job(&workers[victim], 1);
+            if (job != NULL) {
+                __atomic_add_fetch(&stats.stolen, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return job;
+}
+
+static void free_job(iopool_job_t *job) {
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    free(job);
+}
+
+/**
+ * Waits until a job is found for worker. The worker advertises itself as
+ * idle before looking once more, so a submitter either sees it idle and
+ * wakes it, or queued the job before that last look.
+ *
+ * @return job
+ */
+static iopool_job_t *wait_job(iopool_worker_t *worker) {
+    uint64_t bit = (uint64_t)1 << worker->id;
+    iopool_job_t *job = find_job(worker);
+    while (job == NULL) {
+        __atomic_or_fetch(&idle_workers, bit, __ATOMIC_SEQ_CST);
+        job = find_job(worker);
+        if (job == NULL) {
+            pthread_mutex_lock(&worker->lock);
+            while (worker->head == NULL && !worker->woken) {
+                pthread_cond_wait(&worker->cond, &worker->lock);
+            }
+            worker->woken = 0;
+            pthread_mutex_unlock(&worker->lock);
+        }
+        __atomic_and_fetch(&idle_workers, ~bit, __ATOMIC_SEQ_CST);
+        if (job == NULL) {
+            job = find_job(worker);
+        }
+    }
+    return job;
+}
+
+/**
+ * Worker loop: runs jobs from its own queue or stolen ones, sleeping while
+ * there are none
+ *
+ * @param worker_data iopool_worker_t of this worker
+ * @return NULL
+ */
+static void *run_worker(void *worker_data) {
+    iopool_worker_t *worker = worker_data;
+    while (1) {
+        iopool_job_t *job = wait_job(worker);
+        __atomic_add_fetch(&stats.busy_workers, 1, __ATOMIC_RELAXED);
+        job->fn(job->arg);
+
+        pthread_mutex_lock(&job->lock);
+        job->done = 1;
+        int abandoned = job->abandoned;
+        pthread_cond_signal(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+        if (abandoned) {
+            if (job->release != NULL) {
+                job->release(job->arg);
+            }
+            free_job(job);
+        }
+
+        __atomic_sub_fetch(&stats.busy_workers, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.completed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the worker threads of the pool
+ *
+ * @param size number of workers; clamped to [1, MAX_IO_WORKERS]
+ * @return number of workers started
+ */
+int iopool_init(int size) {
+    if (size < 1) {
+        size = 1;
+    }
+    if (size > MAX_IO_WORKERS) {
+        size = MAX_IO_WORKERS;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, IO_STACK_SIZE);
+    for (num_workers = 0; num_workers < size; num_workers++) {
+        iopool_worker_t *worker = &workers[num_workers];
+        worker->id = num_workers;
+        worker->woken = 0;
+        worker->head = NULL;
+        worker->tail = NULL;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        if (pthread_create(&worker->thread, &attr, run_worker, worker) != 0) {
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    stats.num_workers = num_workers;
+    return num_workers;
+}
+
+/**
+ * Splits the workers into count groups and pins group g to the CPUs c with
+ * group_of[c] == g. Call before jobs are submitted from more than one CPU.
+ *
+ * @param group_of group of each CPU, or -1 if jobs from it go to any worker
+ * @param cpus length of group_of
+ * @param count number of groups
+ * @return 1 if the workers were grouped; 0 if there are fewer than count
+ */
+int iopool_set_groups(const int group_of[], int cpus, int count) {
+    if (count < 1 || num_workers < count) {
+        return 0;
+    }
+    group_of_cpu = malloc(cpus * sizeof(int));
+    if (group_of_cpu == NULL) {
+        return 0;
+    }
+    memcpy(group_of_cpu, group_of, cpus * sizeof(int));
+    num_cpus = cpus;
+    for (int w = 0; w < num_workers; w++) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < cpus; cpu++) {
+            if (group_of[cpu] == w % count) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        if (CPU_COUNT(&set) > 0) {
+            pthread_setaffinity_np(workers[w].thread, sizeof(set), &set);
+        }
+    }
+    __atomic_store_n(&num_groups, count, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Picks the worker to queue a job on: round-robin over the workers of the
+ * group running on this CPU, or over all workers
+ */
+static iopool_worker_t *pick_worker() {
+    unsigned int n = __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED);
+    int groups = __atomic_load_n(&num_groups, __ATOMIC_ACQUIRE);
+    int cpu = groups > 1 ? sched_getcpu() : -1;
+    int group = cpu >= 0 && cpu < num_cpus ? group_of_cpu[cpu] : -1;
+    if (group < 0) {
+        return &workers[n % num_workers];
+    }
+    int group_size = (num_workers - group + groups - 1) / groups;
+    return &workers[group + groups * (n % group_size)];
+}
+
+/**
+ * Wakes a worker for a job just queued on worker: worker itself if idle,
+ * else an idle worker of its group, else any idle worker, which will
+ * steal the job
+ */
+static void wake_worker(iopool_worker_t *worker) {
+    uint64_t idle = __atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST);
+    if (idle == 0) {
+        return;
+    }
+    iopool_worker_t *target = NULL;
+    if (idle & ((uint64_t)1 << worker->id)) {
+        target = worker;
+    } else {
+        int groups = __atomic_load_n(&num_groups, __ATOMIC_ACQUIRE);
+        for (uint64_t rest = idle; rest != 0 && target == NULL; rest &= rest - 1) {
+            int id = __builtin_ctzll(rest);
+            if (id % groups == worker->id % groups) {
+                target = &workers[id];
+            }
+        }
+        if (target == NULL) {
+            target = &workers[__builtin_ctzll(idle)];
+        }
+    }
+    pthread_mutex_lock(&target->lock);
+    target->woken = 1;
+    pthread_cond_signal(&target->cond);
+    pthread_mutex_unlock(&target->lock);
+}
+
+/**
+ * Runs fn(arg) on a pool worker and waits up to timeout_ms for it to finish.
+ * On timeout the job keeps running, arg becomes owned by the pool and
+ * release(arg) is called once fn returns, so arg must be heap allocated.
+ * Without workers fn runs on the calling thread.
+ *
+ * @param fn blocking operation
+ * @param release cleanup for arg and its results if the caller gave up
+ * @param arg argument and result storage for fn
+ * @param timeout_ms maximum wait in milliseconds
+ * @return 0 if fn completed; else -1 if the wait timed out
+ */
+int iopool_run(iopool_fn_t fn, iopool_fn_t release, void *arg, int timeout_ms) {
+    iopool_job_t *job = num_workers > 0 ? malloc(sizeof(iopool_job_t)) : NULL;
+    if (job == NULL) {
+        fn(arg);
+        return 0;
+    }
+    job->fn = fn;
+    job->release = release;
+    job->arg = arg;
+    job->done = 0;
+    job->abandoned = 0;
+    job->next = NULL;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    iopool_worker_t *worker = pick_worker();
+    pthread_mutex_lock(&worker->lock);
+    job->prev = worker->tail;
+    if (worker->tail != NULL) {
+        worker->tail->next = job;
+    } else {
+        worker->head = job;
+    }
+    worker->tail = job;
+    int depth = __atomic_add_fetch(&stats.queue_depth, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&worker->lock);
+
+    __atomic_add_fetch(&stats.submitted, 1, __ATOMIC_RELAXED);
+    int max_depth = __atomic_load_n(&stats.max_queue_depth, __ATOMIC_RELAXED);
+    while (depth > max_depth && !__atomic_compare_exchange_n(&stats.max_queue_depth, &max_depth, depth, 0,
+                                                             __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    wake_worker(worker);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->done) {
+        if (pthread_cond_timedwait(&job->cond, &job->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int done = job->done;
+    if (!done) {
+        job->abandoned = 1;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    if (!done) {
+        __atomic_add_fetch(&stats.abandoned, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    free_job(job);
+    return 0;
+}
+
+/**
+ * Copies a snapshot of pool counters into out
+ *
+ * @param out return stats
+ */
+void iopool_get_stats(iopool_stats_t *out) {
+    out->num_workers = num_workers;
+    out->busy_workers = __atomic_load_n(&stats.busy_workers, __ATOMIC_RELAXED);
+    out->queue_depth = __atomic_load_n(&stats.queue_depth, __ATOMIC_RELAXED);
+    out->max_queue_depth = __atomic_load_n(&stats.max_queue_depth, __ATOMIC_RELAXED);
+    out->submitted = __atomic_load_n(&stats.submitted, __ATOMIC_RELAXED);
+    out->completed = __atomic_load_n(&stats.completed, __ATOMIC_RELAXED);
+    out->stolen = __atomic_load_n(&stats.stolen, __ATOMIC_RELAXED);
+    out->abandoned = __atomic_load_n(&stats.abandoned, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,31 @@
+#ifndef __IOPOOL_H__
+#define __IOPOOL_H__
+
+#include <pthread.h>
+
+#define DEFAULT_IO_WORKERS 4
+#define MAX_IO_WORKERS 64
+#define IO_STACK_SIZE (128 * 1024)
+
+typedef void (*iopool_fn_t)(void *arg);
+
+typedef struct iopool_stats_s {
+    int num_workers;
+    int busy_workers;
+    int queue_depth;
+    int max_queue_depth;
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long stolen;
+    unsigned long abandoned;
+} iopool_stats_t;
+
+int iopool_init(int num_workers);
+
+int iopool_set_groups(const int group_of[], int cpus, int count);
+
+int iopool_run(iopool_fn_t fn, iopool_fn_t release, void *arg, int timeout_ms);
+
+void iopool_get_stats(iopool_stats_t *stats);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,16 +8,66 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 
+#include "coalesce.h"
 #include "ftpservice.h"
+#include "fswatch.h"
+#include "iopool.h"
+#include "nameindex.h"
+#include "pack.h"
+#include "statcache.h"
+#include "storage.h"
+#include "trace.h"
+#include "transfer.h"
 
 #define PORT 2121
-#define MAX_CLIENT_CONNECTIONS 4
+#define LISTEN_FD_ENV "FTP_LISTEN_FD"
+#define READY_FD_ENV "FTP_READY_FD"
+#define RELOAD_READY_SECONDS 30  // time a new process has to start accepting
+#define HANDOFF_FD 3
+#define DEFAULT_DRAIN_SECONDS 300
+#define MAX_SHARDS 256
+#define SHARD_STACK_SIZE (64 * 1024)
 
-client_session_t sessions[MAX_CLIENT_CONNECTIONS];
+// An accept thread with its own listening socket and session slots, pinned
+// to the CPUs whose connections the kernel steers to its socket
+typedef struct shard_s {
+    int id;
+    int serverfd;
+    int first_session;  // prefers sessions [first_session, first_session + num_sessions)
+    int num_sessions;
+    int pinned;
+    cpu_set_t cpus;
+    pthread_t thread;
+} shard_t;
+
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t drain_requested = 0;
+
+static shard_t shards[MAX_SHARDS];
+static int num_shards;
+static int shard_of_cpu[CPU_SETSIZE];
+static int stop_pipe[2];  // readable once shards should stop accepting
+static uint32_t num_accepted;
+
+extern char **environ;
+
+client_session_t *sessions;
+int max_sessions;
+int connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
 
 char *root_directory;
 int hostip_octets[4];
@@ -25,24 +76,322 @@ cmd_map_t cmd_map[NUM_CMDS] = {
     {"SYST", CMD_SYST}, {"PWD", CMD_PWD},   {"CWD", CMD_CWD},
     {"CDUP", CMD_CDUP}, {"TYPE", CMD_TYPE}, {"MODE", CMD_MODE},
     {"STRU", CMD_STRU}, {"RETR", CMD_RETR}, {"PORT", CMD_PORT},
-    {"PASV", CMD_PASV}, {"LIST", CMD_LIST}, {"NLST", CMD_NLST}};
+    {"PASV", CMD_PASV}, {"LIST", CMD_LIST}, {"NLST", CMD_NLST},
+    {"SITE", CMD_SITE}, {"FEAT", CMD_FEAT}, {"SIZE", CMD_SIZE},
+    {"MDTM", CMD_MDTM}, {"MLST", CMD_MLST}, {"AUTH", CMD_AUTH},
+    {"PBSZ", CMD_PBSZ}, {"PROT", CMD_PROT}, {"EPRT", CMD_EPRT}};
 
-int next_session() {
-    int i;
-    for (i = 0; i < MAX_CLIENT_CONNECTIONS; i++) {
-        if (sessions[i].state == STATE_EXITED) {
-            pthread_join(sessions[i].session_thread, NULL);
-            sessions[i].state = STATE_OPEN;
-        }
+/**
+ * Claims session slot i for a new client if it is free, joining the thread
+ * of an exited session first. Shards claim each other's slots when their
+ * own are full, so slots change hands by compare-and-swap.
+ *
+ * @param i index into sessions
+ * @return 1 if the slot is now STATE_AWAITING_USER and owned by the caller
+ */
+static int claim_session(int i) {
+    session_state_t expected = STATE_EXITED;
+    if (__atomic_compare_exchange_n(&sessions[i].state, &expected, STATE_AWAITING_USER, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        pthread_join(sessions[i].session_thread, NULL);
+        return 1;
     }
-    for (i = 0; i < MAX_CLIENT_CONNECTIONS; i++) {
-        if (sessions[i].state == STATE_OPEN) {
+    expected = STATE_OPEN;
+    return __atomic_compare_exchange_n(&sessions[i].state, &expected, STATE_AWAITING_USER, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Finds and claims a free session slot, preferring the slots of shard and
+ * falling back to those of the other shards once they are all in use
+ *
+ * @param shard
+ * @return index into sessions; -1 if every slot is in use
+ */
+int next_session(shard_t *shard) {
+    for (int n = 0; n < max_sessions; n++) {
+        int i = (shard->first_session + n) % max_sessions;
+        if (claim_session(i)) {
             return i;
         }
     }
     return -1;
 }
 
+void handle_signal(int signum) {
+    if (signum == SIGHUP) {
+        reload_requested = 1;
+    }
+    drain_requested = 1;
+}
+
+/**
+ * Gets the listening sockets handed off by a previous server process if
+ * LISTEN_FD_ENV is set, as a comma separated list of fds, then opens new
+ * ones on port until there are count. Sockets share the port through
+ * SO_REUSEPORT and keep their order across reloads.
+ *
+ * @param port port to listen on
+ * @param fds return listening socket fds
+ * @param count number of sockets wanted
+ * @return number of sockets in fds, more than count if more were
+ *         inherited; -1 on failure
+ */
+int open_server_sockets(int port, int fds[], int count) {
+    int num_fds = 0;
+    char *listen_fds = getenv(LISTEN_FD_ENV);
+    if (listen_fds != NULL) {
+        char *saveptr = NULL;
+        for (char *token = strtok_r(listen_fds, ",", &saveptr); token != NULL && num_fds < MAX_SHARDS;
+             token = strtok_r(NULL, ",", &saveptr)) {
+            int fd = atoi(token);
+            int listening = 0;
+            socklen_t len = sizeof(listening);
+            if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == -1 || !listening) {
+                printf("Inherited fd %d is not a listening socket\n", fd);
+                return -1;
+            }
+            fds[num_fds++] = fd;
+        }
+        unsetenv(LISTEN_FD_ENV);
+        printf("Inherited %d listening sockets from previous process\n", num_fds);
+    }
+    while (num_fds < count) {
+        int fd = open_port(port);
+        if (fd == -1) {
+            return -1;
+        }
+        fds[num_fds++] = fd;
+    }
+    return num_fds;
+}
+
+/**
+ * Gets the absolute path of the running executable. Resolved at startup,
+ * while the path still names this binary, so a reload execs whatever has
+ * since been installed there. argv0 is only used without /proc.
+ *
+ * @param argv0 argv[0] of this process
+ * @return path that should be freed by caller; NULL if unknown
+ */
+char *get_binary_path(const char *argv0) {
+    char *path = malloc(PATH_MAX);
+    ssize_t len = path != NULL ? readlink("/proc/self/exe", path, PATH_MAX - 1) : -1;
+    if (len > 0) {
+        path[len] = '\0';
+        return path;
+    }
+    free(path);
+    return realpath(argv0, NULL);
+}
+
+/**
+ * Copies the environment of this process for a new server process,
+ * replacing the handoff variables. The environment is built rather than
+ * changed with setenv, which is unsafe while other threads run.
+ *
+ * @param listen_fds value of LISTEN_FD_ENV
+ * @param ready_fd value of READY_FD_ENV
+ * @return NULL-terminated environment that should be freed by caller,
+ *         strings included; NULL on allocation failure
+ */
+char **build_environment(const char *listen_fds, int ready_fd) {
+    int count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+    char **envp = calloc(count + 3, sizeof(char *));
+    if (envp == NULL) {
+        return NULL;
+    }
+    int n = 0;
+    size_t listen_len = strlen(LISTEN_FD_ENV);
+    size_t ready_len = strlen(READY_FD_ENV);
+    int failed = 0;
+    for (int i = 0; i < count && !failed; i++) {
+        if ((strncmp(environ[i], LISTEN_FD_ENV, listen_len) == 0 && environ[i][listen_len] == '=') ||
+            (strncmp(environ[i], READY_FD_ENV, ready_len) == 0 && environ[i][ready_len] == '=')) {
+            continue;
+        }
+        envp[n] = strdup(environ[i]);
+        failed = envp[n++] == NULL;
+    }
+    if (!failed) {
+        failed = asprintf(&envp[n], "%s=%s", LISTEN_FD_ENV, listen_fds) == -1;
+        if (failed) {
+            envp[n] = NULL;
+        }
+    }
+    if (!failed) {
+        failed = asprintf(&envp[n + 1], "%s=%d", READY_FD_ENV, ready_fd) == -1;
+        if (failed) {
+            envp[n + 1] = NULL;
+        }
+    }
+    if (failed) {
+        for (int i = 0; envp[i] != NULL; i++) {
+            free(envp[i]);
+        }
+        free(envp);
+        return NULL;
+    }
+    return envp;
+}
+
+/**
+ * Starts a new server process from binary that inherits the listening
+ * sockets, in order, as fds from HANDOFF_FD, so the new process accepts
+ * clients while this one drains its sessions. The new process also gets
+ * the write end of a pipe as READY_FD_ENV and writes to it once it accepts
+ * clients. Only async-signal-safe calls are made between fork and exec.
+ *
+ * @param serverfds listening socket fds
+ * @param count number of listening sockets
+ * @param binary path of server executable
+ * @param argv arguments of this process
+ * @param readyfd return read end of the readiness pipe
+ * @return pid of new process; -1 on failure
+ */
+pid_t reload_server(int serverfds[], int count, char *binary, char **argv, int *readyfd) {
+    char fdlist[MAX_SHARDS * 5];
+    int len = 0;
+    for (int i = 0; i < count; i++) {
+        len += snprintf(fdlist + len, sizeof(fdlist) - len, i == 0 ? "%d" : ",%d", HANDOFF_FD + i);
+    }
+    int ready_pipe[2];
+    if (pipe2(ready_pipe, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    char **envp = build_environment(fdlist, HANDOFF_FD + count);
+    if (envp == NULL) {
+        close(ready_pipe[0]);
+        close(ready_pipe[1]);
+        return -1;
+    }
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Move every fd above the handoff range first, so placing one
+        // cannot overwrite another that is still to be placed
+        int moved[MAX_SHARDS + 1];
+        for (int i = 0; i <= count; i++) {
+            moved[i] = fcntl(i < count ? serverfds[i] : ready_pipe[1], F_DUPFD, HANDOFF_FD + count + 1);
+            if (moved[i] == -1) {
+                _exit(1);
+            }
+        }
+        for (int i = 0; i <= count; i++) {
+            if (dup2(moved[i], HANDOFF_FD + i) == -1) {
+                _exit(1);
+            }
+        }
+        // Client and data sockets must not outlive this process
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, HANDOFF_FD + count + 1, ~0U, 0) == -1)
+#endif
+        {
+            struct rlimit limit;
+            getrlimit(RLIMIT_NOFILE, &limit);
+            for (int fd = HANDOFF_FD + count + 1; fd < (int)limit.rlim_cur; fd++) {
+                close(fd);
+            }
+        }
+        execve(binary, argv, envp);
+        _exit(1);
+    }
+    for (int i = 0; envp[i] != NULL; i++) {
+        free(envp[i]);
+    }
+    free(envp);
+    close(ready_pipe[1]);
+    if (pid == -1) {
+        close(ready_pipe[0]);
+        return -1;
+    }
+    *readyfd = ready_pipe[0];
+    return pid;
+}
+
+/**
+ * Waits for a process started by reload_server to accept clients. A
+ * process that exits or does not become ready within
+ * RELOAD_READY_SECONDS is killed and reaped.
+ *
+ * @param pid new process
+ * @param readyfd read end of its readiness pipe; closed
+ * @return 1 if the process is accepting clients; else 0
+ */
+int await_successor(pid_t pid, int readyfd) {
+    struct pollfd pfd = {.fd = readyfd, .events = POLLIN};
+    char byte;
+    int ready = 0;
+    time_t deadline = time(NULL) + RELOAD_READY_SECONDS;
+    while (!ready && time(NULL) < deadline) {
+        int status = poll(&pfd, 1, 1000);
+        if (status == -1 && errno != EINTR) {
+            break;
+        }
+        if (status > 0) {
+            // EOF means the process exited, or exec failed, before it was ready
+            ready = read(readyfd, &byte, 1) == 1;
+            break;
+        }
+    }
+    close(readyfd);
+    if (!ready) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    return ready;
+}
+
+/**
+ * Tells the process that started this one by reload_server that clients
+ * are being accepted, if there is one
+ */
+void signal_ready(int readyfd) {
+    if (readyfd != -1) {
+        write(readyfd, "", 1);
+        close(readyfd);
+    }
+}
+
+/**
+ * Waits for active sessions to finish. Sessions still open after
+ * drain_seconds have their control and data connections shut down.
+ *
+ * @param drain_seconds deadline in seconds
+ */
+void drain_sessions(int drain_seconds) {
+    time_t deadline = time(NULL) + drain_seconds;
+    int active;
+    do {
+        active = 0;
+        for (int i = 0; i < max_sessions; i++) {
+            client_session_t *session = &sessions[i];
+            if (__atomic_load_n(&session->state, __ATOMIC_ACQUIRE) == STATE_EXITED) {
+                pthread_join(session->session_thread, NULL);
+                session->state = STATE_OPEN;
+            }
+            if (session->state == STATE_OPEN) {
+                continue;
+            }
+            active++;
+            if (time(NULL) >= deadline) {
+                shutdown(session->clientfd, SHUT_RDWR);
+                if (session->data_connection.clientfd != -1) {
+                    shutdown(session->data_connection.clientfd, SHUT_RDWR);
+                }
+            }
+        }
+        if (active > 0) {
+            printf("Draining %d sessions\n", active);
+            sleep(1);
+        }
+    } while (active > 0);
+}
+
 void set_hostip() {
     struct ifaddrs *if_addrs = NULL;
     void *sin_addr = NULL;
@@ -76,42 +425,323 @@ void set_hostip() {
     }
 }
 
-int main(int argc, char **argv) {
-    // Set root directory
-    root_directory = getenv("FTP_ROOT");
-    if (root_directory == NULL) {
-        perror("Missing FTP_ROOT env variable\n");
-        return 1;
-    }
-    DIR *dir = opendir(root_directory);
-    if (dir == NULL) {
-        perror("FTP_ROOT folder does not exist\n");
-        return 1;
+/**
+ * Accept loop of a shard. Session threads inherit the affinity of the
+ * shard, so a session and its data connections run on the CPUs that
+ * receive its packets.
+ *
+ * @param shard_data shard_t of this thread
+ * @return NULL
+ */
+void *run_shard(void *shard_data) {
+    shard_t *shard = shard_data;
+    if (shard->pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &shard->cpus);
     }
-    closedir(dir);
-
-    int serverfd = open_port(PORT);
-    set_hostip();
-    printf("Listening on port %d\n", PORT);
-
-    int clientfd;
-    int sessionid;
-    client_session_t *session;
     struct sockaddr_in sin;
-    socklen_t addrlen = sizeof(sin);
+    socklen_t addrlen;
+    struct pollfd pfds[2] = {{.fd = shard->serverfd, .events = POLLIN}, {.fd = stop_pipe[0], .events = POLLIN}};
     while (1) {
-        clientfd = accept(serverfd, (struct sockaddr *)&sin, &addrlen);
-        sessionid = next_session();
+        if (poll(pfds, 2, -1) <= 0) {
+            continue;
+        }
+        if (pfds[1].revents != 0) {
+            break;
+        }
+        addrlen = sizeof(sin);
+        int clientfd = accept(shard->serverfd, (struct sockaddr *)&sin, &addrlen);
+        if (clientfd == -1) {
+            continue;
+        }
+        int sessionid = next_session(shard);
         if (sessionid == -1) {
             printf("Max capacity reached: cannot accept client\n");
             close(clientfd);
             continue;
         }
-        session = &sessions[sessionid];
+        // Replies are complete lines; don't hold one back waiting for the
+        // client to acknowledge the previous reply
+        int nodelay = 1;
+        setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        client_session_t *session = &sessions[sessionid];
         session->clientfd = clientfd;
-        session->state = STATE_AWAITING_USER;
-        pthread_create(&session->session_thread, NULL, handle_session, (void *)session);
+        session->trace_id = __atomic_add_fetch(&num_accepted, 1, __ATOMIC_RELAXED);
+        if (start_thread(&session->session_thread, handle_session, (void *)session, SESSION_STACK_SIZE) != 0) {
+            printf("Could not start session thread: closing client\n");
+            close(clientfd);
+            __atomic_store_n(&session->state, STATE_OPEN, __ATOMIC_RELEASE);
+            continue;
+        }
         printf("FTP session opened (connect).\n");
     }
+    return NULL;
+}
+
+/**
+ * Gives each shard a listening socket and its CPUs: the allowed CPUs are
+ * numbered by rank, skipping CPUs outside the set, and the CPU of rank r
+ * goes to shard r % num_shards. shard_of_cpu maps each CPU to its shard for
+ * steer_by_cpu, or -1 if not allowed. When pinned, shard i runs on its CPUs.
+ *
+ * @param serverfds listening sockets, one per shard
+ * @param allowed CPUs this process may run on
+ * @param pin 1 to pin shards to their CPUs
+ */
+void assign_shards(int serverfds[], const cpu_set_t *allowed, int pin) {
+    for (int i = 0; i < num_shards; i++) {
+        shards[i].id = i;
+        shards[i].serverfd = serverfds[i];
+        CPU_ZERO(&shards[i].cpus);
+    }
+    int rank = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        shard_of_cpu[cpu] = -1;
+        if (CPU_ISSET(cpu, allowed)) {
+            shard_of_cpu[cpu] = rank++ % num_shards;
+            CPU_SET(cpu, &shards[shard_of_cpu[cpu]].cpus);
+        }
+    }
+    for (int i = 0; i < num_shards; i++) {
+        shards[i].pinned = pin && CPU_COUNT(&shards[i].cpus) > 0;
+    }
+}
+
+/**
+ * Divides the session slots between shards. Steered connections arrive in
+ * proportion to the CPUs of each shard and slots are shared the same way;
+ * otherwise the kernel spreads connections evenly by hash. A shard that fills up borrows the
+ * slots of others, so this only decides where each shard looks first.
+ *
+ * @param steered 1 if connections are steered by CPU
+ */
+void share_sessions(int steered) {
+    int total = 0;
+    for (int i = 0; i < num_shards; i++) {
+        total += steered ? CPU_COUNT(&shards[i].cpus) : 1;
+    }
+    int first_session = 0;
+    int weight = 0;
+    for (int i = 0; i < num_shards; i++) {
+        weight += steered ? CPU_COUNT(&shards[i].cpus) : 1;
+        int end = (int)((long long)max_sessions * weight / total);
+        shards[i].first_session = first_session;
+        shards[i].num_sessions = end - first_session;
+        first_session = end;
+    }
+}
+
+int main(int argc, char **argv) {
+    // Set by reload_server in a process started by SIGHUP
+    char *ready_env = getenv(READY_FD_ENV);
+    int ready_fd = ready_env != NULL ? atoi(ready_env) : -1;
+    unsetenv(READY_FD_ENV);
+
+    // Set root directory, or serve a packed image in its place
+    char *pack_path = getenv("FTP_PACK");
+    if (pack_path != NULL) {
+        if (!pack_open(pack_path)) {
+            perror("FTP_PACK is not a valid pack image\n");
+            return 1;
+        }
+        storage = &pack_storage;
+        root_directory = "";
+    } else {
+        root_directory = getenv("FTP_ROOT");
+        if (root_directory == NULL) {
+            perror("Missing FTP_ROOT env variable\n");
+            return 1;
+        }
+        DIR *dir = opendir(root_directory);
+        if (dir == NULL) {
+            perror("FTP_ROOT folder does not exist\n");
+            return 1;
+        }
+        closedir(dir);
+    }
+
+    // Client aborts mid-transfer should fail the write, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGHUP hands the listening socket to a new process and drains;
+    // SIGTERM only drains. Both stay blocked outside of the main thread's
+    // wait below, so shard and session threads never receive them.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_signal;
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigset_t drain_signals;
+    sigset_t accept_mask;
+    sigemptyset(&drain_signals);
+    sigaddset(&drain_signals, SIGHUP);
+    sigaddset(&drain_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &drain_signals, &accept_mask);
+    sigdelset(&accept_mask, SIGHUP);  // may be inherited blocked from reload
+    sigdelset(&accept_mask, SIGTERM);
+    char *drain_env = getenv("FTP_DRAIN_SECONDS");
+    int drain_seconds = drain_env != NULL ? atoi(drain_env) : DEFAULT_DRAIN_SECONDS;
+    char *binary = get_binary_path(argv[0]);
+
+    // Allocate session slots
+    char *max_sessions_env = getenv("FTP_MAX_SESSIONS");
+    max_sessions = max_sessions_env != NULL ? atoi(max_sessions_env) : DEFAULT_MAX_SESSIONS;
+    if (max_sessions < 1) {
+        max_sessions = DEFAULT_MAX_SESSIONS;
+    }
+    sessions = aligned_alloc(CACHE_LINE_SIZE, max_sessions * sizeof(client_session_t));
+    if (sessions == NULL) {
+        perror("Could not allocate sessions\n");
+        return 1;
+    }
+    memset(sessions, 0, max_sessions * sizeof(client_session_t));
+    for (int i = 0; i < max_sessions; i++) {
+        sessions[i].data_connection.clientfd = -1;
+        sessions[i].data_connection.passivefd = -1;
+    }
+    printf("Accepting up to %d sessions of %zu bytes each\n", max_sessions, session_footprint());
+
+    // Start workers for blocking filesystem calls
+    char *io_workers = getenv("FTP_IO_WORKERS");
+    int num_io_workers = io_workers != NULL ? atoi(io_workers) : DEFAULT_IO_WORKERS;
+    num_io_workers = iopool_init(num_io_workers);
+    if (num_io_workers == 0) {
+        perror("Could not start IO workers\n");
+        return 1;
+    }
+    printf("Started %d IO workers\n", num_io_workers);
+
+    // Cache metadata while inotify can keep it coherent
+    if (storage == &fs_storage) {
+        int watching = fswatch_init();
+        if (!statcache_init() || !watching) {
+            printf("inotify unavailable: metadata will not be cached\n");
+        }
+        char *index_env = getenv("FTP_NAME_INDEX");
+        if (watching && (index_env == NULL || atoi(index_env) != 0) && nameindex_init(root_directory)) {
+            printf("Indexing file names under %s\n", root_directory);
+        }
+    } else {
+        printf("Serving pack image %s\n", pack_path);
+    }
+
+    // Enable AUTH TLS if a certificate is configured
+    char *tls_cert = getenv("FTP_TLS_CERT");
+    char *tls_key = getenv("FTP_TLS_KEY");
+    if (tls_cert != NULL && tls_key != NULL && tls_init(tls_cert, tls_key)) {
+        printf("TLS enabled with kernel offload\n");
+    }
+
+    // Record command timings for replay
+    char *trace_path = getenv("FTP_TRACE_FILE");
+    if (trace_path != NULL) {
+        if (trace_open(trace_path)) {
+            printf("Writing session trace to %s\n", trace_path);
+        } else {
+            printf("Could not open trace file %s\n", trace_path);
+        }
+    }
+
+    // Bound how long PORT and EPRT wait for the client to accept
+    char *connect_timeout_env = getenv("FTP_CONNECT_TIMEOUT_MS");
+    if (connect_timeout_env != NULL && atoi(connect_timeout_env) > 0) {
+        connect_timeout_ms = atoi(connect_timeout_env);
+    }
+
+    // Files at least this large bypass the page cache
+    char *direct_env = getenv("FTP_DIRECT_THRESHOLD");
+    if (direct_env != NULL) {
+        direct_threshold = atoll(direct_env);
+    }
+
+    // Concurrent downloads of files at least this large share their reads
+    char *coalesce_env = getenv("FTP_COALESCE_MIN");
+    if (coalesce_env != NULL) {
+        coalesce_min = atoll(coalesce_env);
+    }
+    char *chunks_env = getenv("FTP_COALESCE_CHUNKS");
+    if (chunks_env != NULL && atoi(chunks_env) >= MIN_COALESCE_CHUNKS) {
+        coalesce_chunks = atoi(chunks_env);
+    }
+
+    // One accept thread per shard; with FTP_SHARDS set, each shard is
+    // pinned to its share of CPUs and the kernel steers connections to the
+    // shard running on the CPU that received them
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        CPU_SET(0, &allowed);
+    }
+    char *shards_env = getenv("FTP_SHARDS");
+    num_shards = shards_env == NULL ? 1 : atoi(shards_env) > 0 ? atoi(shards_env) : CPU_COUNT(&allowed);
+    if (num_shards > MAX_SHARDS) {
+        num_shards = MAX_SHARDS;
+    }
+    if (num_shards > max_sessions) {
+        num_shards = max_sessions;
+    }
+    int serverfds[MAX_SHARDS];
+    num_shards = open_server_sockets(PORT, serverfds, num_shards);
+    if (num_shards == -1) {
+        return 1;
+    }
+    for (int i = 0; i < num_shards; i++) {
+        fcntl(serverfds[i], F_SETFL, fcntl(serverfds[i], F_GETFL) | O_NONBLOCK);
+    }
+    assign_shards(serverfds, &allowed, shards_env != NULL);
+    int steered = num_shards > 1 && steer_by_cpu(serverfds[0], shard_of_cpu, CPU_SETSIZE, num_shards);
+    if (num_shards > 1 && !steered) {
+        printf("Could not steer connections by CPU: spreading them by hash\n");
+    }
+    share_sessions(steered);
+    // Keep each shard's blocking IO on its own CPUs
+    if (shards_env != NULL && num_shards > 1 && !iopool_set_groups(shard_of_cpu, CPU_SETSIZE, num_shards)) {
+        printf("Fewer IO workers than shards: IO workers are shared by all shards\n");
+    }
+    set_hostip();
+    if (pipe(stop_pipe) == -1) {
+        perror("Could not create pipe\n");
+        return 1;
+    }
+    for (int i = 0; i < num_shards; i++) {
+        if (start_thread(&shards[i].thread, run_shard, &shards[i], SHARD_STACK_SIZE) != 0) {
+            perror("Could not start shard\n");
+            return 1;
+        }
+    }
+    printf("Listening on port %d with %d shards\n", PORT, num_shards);
+    fflush(stdout);
+    signal_ready(ready_fd);
+
+    // On SIGHUP keep accepting until the new process accepts too, so
+    // connections arriving during its startup are not left in the backlog
+    while (1) {
+        while (!drain_requested) {
+            ppoll(NULL, 0, NULL, &accept_mask);
+        }
+        if (!reload_requested) {
+            break;
+        }
+        int readyfd;
+        pid_t pid = binary != NULL ? reload_server(serverfds, num_shards, binary, argv, &readyfd) : -1;
+        if (pid != -1 && await_successor(pid, readyfd)) {
+            printf("Handed %d listening sockets to process %d\n", num_shards, pid);
+            break;
+        }
+        printf("Reload failed: server binary could not be started\n");
+        reload_requested = 0;
+        drain_requested = 0;
+    }
+    write(stop_pipe[1], "", 1);
+    for (int i = 0; i < num_shards; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+    for (int i = 0; i < num_shards; i++) {
+        close(serverfds[i]);
+    }
+    printf("Stopped accepting clients, draining sessions for up to %d seconds\n", drain_seconds);
+    drain_sessions(drain_seconds);
+    printf("All sessions closed\n");
+    trace_close();
+    free(binary);
     return 0;
 }
@@ -0,0 +1,217 @@
+/**
+ * @file mkpack.c
+ * Builds a pack image of a directory tree for serving with FTP_PACK
+ *
+ * Regular files and directories are packed; symlinks and special files are
+ * skipped. The image is written next to the output path and renamed over
+ * it when complete, so a server mapping the previous image is unaffected.
+ *
+ * Usage: mkpack <directory> <output>
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pack.h"
+#include "transfer.h"
+
+#define COPY_BUF_SIZE (1024 * 1024)
+#define MAX_OPEN_DIRS 64
+
+typedef struct pack_input_s {
+    char *path;  // relative to the packed root
+    uint32_t mode;
+    uint64_t size;
+    int64_t mtime;
+} pack_input_t;
+
+static pack_input_t *inputs;
+static uint32_t num_inputs;
+static uint32_t max_inputs;
+static size_t root_len;
+
+/**
+ * nftw callback collecting packable entries
+ */
+static int collect(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    if (ftw->level == 0 || (flag != FTW_F && flag != FTW_D)) {
+        return 0;
+    }
+    if (!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode)) {
+        return 0;
+    }
+    const char *relpath = path + root_len + 1;
+    if (strlen(relpath) >= PACK_PATH_LEN) {
+        fprintf(stderr, "Skipping %s: path too long\n", path);
+        return 0;
+    }
+    if (num_inputs == max_inputs) {
+        max_inputs = max_inputs > 0 ? max_inputs * 2 : 1024;
+        inputs = realloc(inputs, max_inputs * sizeof(pack_input_t));
+        if (inputs == NULL) {
+            return -1;
+        }
+    }
+    pack_input_t *input = &inputs[num_inputs++];
+    input->path = strdup(relpath);
+    input->mode = st->st_mode;
+    input->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+    input->mtime = st->st_mtime;
+    return input->path == NULL ? -1 : 0;
+}
+
+static int compare_inputs(const void *a, const void *b) {
+    return strcmp(((const pack_input_t *)a)->path, ((const pack_input_t *)b)->path);
+}
+
+/**
+ * Copies exactly size bytes of the file at path to outfd. A file that
+ * cannot be read, or whose size changed since it was collected, fails the
+ * pack rather than being packed with wrong contents.
+ *
+ * @return 0 on success; -1 on read or write failure
+ */
+static int copy_contents(int outfd, const char *path, uint64_t size, char *buf) {
+    int infd = open(path, O_RDONLY);
+    if (infd == -1) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(infd, &st) == -1 || (uint64_t)st.st_size != size) {
+        fprintf(stderr, "%s changed while packing\n", path);
+        close(infd);
+        return -1;
+    }
+    posix_fadvise(infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    uint64_t copied = 0;
+    while (copied < size) {
+        size_t want = size - copied < COPY_BUF_SIZE ? size - copied : COPY_BUF_SIZE;
+        ssize_t len = read(infd, buf, want);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            if (len == 0) {
+                fprintf(stderr, "%s changed while packing\n", path);
+            } else {
+                perror(path);
+            }
+            close(infd);
+            return -1;
+        }
+        if (write_all(outfd, buf, len) == -1) {
+            close(infd);
+            return -1;
+        }
+        copied += len;
+    }
+    close(infd);
+    return 0;
+}
+
+/**
+ * Writes the header, index, names and contents of the collected entries
+ *
+ * @return 0 on success; -1 on failure
+ */
+static int write_pack(int outfd, const char *root) {
+    pack_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, PACK_MAGIC_LEN);
+    header.version = PACK_VERSION;
+    header.num_entries = num_inputs;
+    header.names_offset = sizeof(pack_header_t) + (uint64_t)num_inputs * sizeof(pack_entry_t);
+
+    pack_entry_t *entries = calloc(num_inputs > 0 ? num_inputs : 1, sizeof(pack_entry_t));
+    if (entries == NULL) {
+        return -1;
+    }
+    uint64_t names_len = 0;
+    for (uint32_t i = 0; i < num_inputs; i++) {
+        entries[i].name_offset = names_len;
+        entries[i].name_len = strlen(inputs[i].path);
+        names_len += entries[i].name_len + 1;
+    }
+    header.data_offset = header.names_offset + names_len;
+    uint64_t offset = header.data_offset;
+    for (uint32_t i = 0; i < num_inputs; i++) {
+        entries[i].offset = offset;
+        entries[i].size = inputs[i].size;
+        entries[i].mtime = inputs[i].mtime;
+        entries[i].mode = inputs[i].mode;
+        offset += inputs[i].size;
+    }
+
+    int status = write_all(outfd, &header, sizeof(header));
+    if (status == 0) {
+        status = write_all(outfd, entries, (size_t)num_inputs * sizeof(pack_entry_t));
+    }
+    for (uint32_t i = 0; status == 0 && i < num_inputs; i++) {
+        status = write_all(outfd, inputs[i].path, entries[i].name_len + 1);
+    }
+    free(entries);
+
+    char *buf = malloc(COPY_BUF_SIZE);
+    char path[PACK_PATH_LEN + PATH_MAX];
+    if (buf == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; status == 0 && i < num_inputs; i++) {
+        if (S_ISREG(inputs[i].mode)) {
+            snprintf(path, sizeof(path), "%s/%s", root, inputs[i].path);
+            status = copy_contents(outfd, path, inputs[i].size, buf);
+        }
+    }
+    free(buf);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <directory> <output>\n", argv[0]);
+        return 1;
+    }
+    char *root = realpath(argv[1], NULL);
+    if (root == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    // Paths under "/" are "/name", so the root adds no separator of its own
+    root_len = strcmp(root, "/") == 0 ? 0 : strlen(root);
+    if (nftw(root, collect, MAX_OPEN_DIRS, FTW_PHYS) != 0) {
+        fprintf(stderr, "Could not read %s\n", root);
+        return 1;
+    }
+    qsort(inputs, num_inputs, sizeof(pack_input_t), compare_inputs);
+
+    char tmppath[PATH_MAX];
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", argv[2]);
+    int outfd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outfd == -1) {
+        perror(tmppath);
+        return 1;
+    }
+    if (write_pack(outfd, root) == -1) {
+        fprintf(stderr, "Could not pack %s\n", root);
+        close(outfd);
+        unlink(tmppath);
+        return 1;
+    }
+    if (fsync(outfd) == -1 || close(outfd) == -1 || rename(tmppath, argv[2]) == -1) {
+        perror(argv[2]);
+        unlink(tmppath);
+        return 1;
+    }
+    printf("Packed %u entries of %s into %s\n", num_inputs, root, argv[2]);
+    return 0;
+}
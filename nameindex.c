@@ -0,0 +1,885 @@
+/**
+ * @file nameindex.c
+ * Index of every path under the served root for server-side search
+ *
+ * A background thread scans the root once, then keeps the index current
+ * from fswatch events: each batch of changed paths is rescanned and spliced
+ * in place into three sorted arrays, ordered by path, by file name and by
+ * reversed file name, so a glob is answered with a binary search on its literal
+ * prefix, or on its literal suffix if it starts with a wildcard, followed by
+ * fnmatch over the matching range. Matches are copied out in bounded
+ * batches and written with the lock released, so a slow client never holds
+ * off updates. Lost events trigger a full rescan; the previous index keeps
+ * answering searches while it runs.
+ *
+ * Public functions:
+ * - nameindex_init
+ * - nameindex_state
+ * - nameindex_find
+ * - nameindex_get_stats
+ *
+ */
+
+#define _GNU_SOURCE
+#include "nameindex.h"
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fswatch.h"
+#include "transfer.h"
+
+typedef struct nameindex_entry_s {
+    unsigned int name_offset;
+    char path[];  // relative to the root, starting with "/"
+} nameindex_entry_t;
+
+typedef struct entry_list_s {
+    nameindex_entry_t **items;
+    size_t len;
+    size_t capacity;
+} entry_list_t;
+
+typedef struct pending_path_s {
+    struct pending_path_s *next;
+    char path[];
+} pending_path_t;
+
+static char root[PATH_MAX];
+static size_t root_len;
+static pthread_t index_thread;
+
+// Guards the sorted arrays, state and stats
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static entry_list_t by_path;
+static entry_list_t by_name;
+static entry_list_t by_suffix;
+static nameindex_state_t state = INDEX_OFF;
+static nameindex_stats_t stats;
+
+// Guards changes queued by the watch thread for the index thread
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static pending_path_t *pending;
+static int num_pending;
+static int rebuild_pending;
+
+static int push_entry(entry_list_t *list, nameindex_entry_t *entry) {
+    if (list->len == list->capacity) {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+        nameindex_entry_t **items = realloc(list->items, capacity * sizeof(nameindex_entry_t *));
+        if (items == NULL) {
+            return 0;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->len++] = entry;
+    return 1;
+}
+
+static void free_entries(entry_list_t *list) {
+    for (size_t i = 0; i < list->len; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+}
+
+static void free_pending(pending_path_t *list) {
+    while (list != NULL) {
+        pending_path_t *next = list->next;
+        free(list);
+        list = next;
+    }
+}
+
+static const char *entry_name(const nameindex_entry_t *entry) {
+    return entry->path + entry->name_offset;
+}
+
+static size_t entry_bytes(const nameindex_entry_t *entry) {
+    return sizeof(nameindex_entry_t) + strlen(entry->path) + 1 + 3 * sizeof(nameindex_entry_t *);
+}
+
+static int compare_path(const void *a, const void *b) {
+    return strcmp((*(nameindex_entry_t **)a)->path, (*(nameindex_entry_t **)b)->path);
+}
+
+static int compare_name(const void *a, const void *b) {
+    nameindex_entry_t *entry_a = *(nameindex_entry_t **)a;
+    nameindex_entry_t *entry_b = *(nameindex_entry_t **)b;
+    int order = strcmp(entry_name(entry_a), entry_name(entry_b));
+    return order != 0 ? order : strcmp(entry_a->path, entry_b->path);
+}
+
+/**
+ * Compares two strings from their last character backwards
+ */
+static int compare_reversed(const char *a, const char *b) {
+    size_t i = strlen(a), j = strlen(b);
+    while (i > 0 && j > 0) {
+        unsigned char char_a = a[--i];
+        unsigned char char_b = b[--j];
+        if (char_a != char_b) {
+            return char_a < char_b ? -1 : 1;
+        }
+    }
+    return (i > 0) - (j > 0);
+}
+
+static int compare_suffix(const void *a, const void *b) {
+    nameindex_entry_t *entry_a = *(nameindex_entry_t **)a;
+    nameindex_entry_t *entry_b = *(nameindex_entry_t **)b;
+    int order = compare_reversed(entry_name(entry_a), entry_name(entry_b));
+    return order != 0 ? order : strcmp(entry_a->path, entry_b->path);
+}
+
+/**
+ * @return index of first entry of by_path whose path is not less than key
+ */
+static size_t path_lower_bound(const char *key) {
+    size_t lo = 0, hi = by_path.len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(by_path.items[mid]->path, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @return index of first entry of by_name whose name is not less than key
+ */
+static size_t name_lower_bound(const char *key) {
+    size_t lo = 0, hi = by_name.len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(entry_name(by_name.items[mid]), key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @return index of first entry of by_suffix whose reversed name is not
+ *         less than reversed key, where names ending with key begin
+ */
+static size_t suffix_lower_bound(const char *key) {
+    size_t lo = 0, hi = by_suffix.len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_reversed(entry_name(by_suffix.items[mid]), key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @return index of first entry of list in [lo, hi), ordered by compare,
+ *         that is not less than key; hi if there is none
+ */
+static size_t range_lower_bound(const entry_list_t *list, size_t lo, size_t hi, const nameindex_entry_t *key,
+                                int (*compare)(const void *, const void *)) {
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare(&list->items[mid], &key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @return index of first entry of list ordered by compare that is not less
+ *         than key
+ */
+static size_t entry_lower_bound(const entry_list_t *list, const nameindex_entry_t *key,
+                                int (*compare)(const void *, const void *)) {
+    return range_lower_bound(list, 0, list->len, key, compare);
+}
+
+static int add_entry(entry_list_t *list, const char *path) {
+    size_t len = strlen(path);
+    nameindex_entry_t *entry = malloc(sizeof(nameindex_entry_t) + len + 1);
+    if (entry == NULL) {
+        return 0;
+    }
+    memcpy(entry->path, path, len + 1);
+    entry->name_offset = strrchr(entry->path, '/') + 1 - entry->path;
+    if (!push_entry(list, entry)) {
+        free(entry);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Watches directory dirpath and adds everything below it to list. Each
+ * watch is added before reading its directory so no entry created
+ * meanwhile is missed. Directories still to be read are kept on a list
+ * rather than recursed into, so only one is open at a time whatever the
+ * depth of the tree.
+ *
+ * @param list output entries
+ * @param dirpath absolute directory path; empty for "/"
+ * @param unwatched incremented for each directory that could not be watched
+ */
+static void scan_dir(entry_list_t *list, const char *dirpath, unsigned long *unwatched) {
+    pending_path_t *dirs = malloc(sizeof(pending_path_t) + strlen(dirpath) + 1);
+    if (dirs == NULL) {
+        return;
+    }
+    strcpy(dirs->path, dirpath);
+    dirs->next = NULL;
+    char path[PATH_MAX];
+    int failed = 0;
+    while (dirs != NULL && !failed) {
+        pending_path_t *next = dirs;
+        dirs = dirs->next;
+        size_t len = strlen(next->path);
+        memcpy(path, next->path, len + 1);
+        free(next);
+
+        // The root "/" is the empty path, so its entries start with "/"
+        const char *dirname = len > 0 ? path : "/";
+        if (!fswatch_add_dir(dirname)) {
+            (*unwatched)++;
+        }
+        DIR *dir = opendir(dirname);
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *dirent;
+        while (!failed && (dirent = readdir(dir)) != NULL) {
+            if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+                continue;
+            }
+            size_t name_len = strlen(dirent->d_name);
+            if (len + name_len + 2 > PATH_MAX) {
+                continue;
+            }
+            path[len] = '/';
+            memcpy(path + len + 1, dirent->d_name, name_len + 1);
+            if (!add_entry(list, path + root_len)) {
+                failed = 1;
+                break;
+            }
+            int is_dir = dirent->d_type == DT_DIR;
+            struct stat st;
+            if (dirent->d_type == DT_UNKNOWN && lstat(path, &st) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+            }
+            if (is_dir) {
+                pending_path_t *subdir = malloc(sizeof(pending_path_t) + len + name_len + 2);
+                if (subdir == NULL) {
+                    failed = 1;
+                    break;
+                }
+                memcpy(subdir->path, path, len + name_len + 2);
+                subdir->next = dirs;
+                dirs = subdir;
+            }
+        }
+        path[len] = '\0';
+        closedir(dir);
+    }
+    free_pending(dirs);
+}
+
+/**
+ * Adds the entry at relative path, and everything below it, to list if it
+ * exists
+ */
+static void scan_path(entry_list_t *list, const char *relpath, unsigned long *unwatched) {
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s%s", root, relpath) >= PATH_MAX) {
+        return;
+    }
+    struct stat st;
+    if (lstat(path, &st) == -1 || !add_entry(list, relpath)) {
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        scan_dir(list, path, unwatched);
+    }
+}
+
+/**
+ * Replaces the index with a fresh scan of the root
+ */
+static void rebuild() {
+    entry_list_t paths = {0};
+    entry_list_t names = {0};
+    entry_list_t suffixes = {0};
+    unsigned long unwatched = 0;
+    scan_dir(&paths, root, &unwatched);
+    qsort(paths.items, paths.len, sizeof(nameindex_entry_t *), compare_path);
+    names.items = malloc(paths.len * sizeof(nameindex_entry_t *) + 1);
+    suffixes.items = malloc(paths.len * sizeof(nameindex_entry_t *) + 1);
+    if (names.items == NULL || suffixes.items == NULL) {
+        free(names.items);
+        free(suffixes.items);
+        free_entries(&paths);
+        return;
+    }
+    memcpy(names.items, paths.items, paths.len * sizeof(nameindex_entry_t *));
+    names.len = names.capacity = paths.len;
+    qsort(names.items, names.len, sizeof(nameindex_entry_t *), compare_name);
+    memcpy(suffixes.items, paths.items, paths.len * sizeof(nameindex_entry_t *));
+    suffixes.len = suffixes.capacity = paths.len;
+    qsort(suffixes.items, suffixes.len, sizeof(nameindex_entry_t *), compare_suffix);
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < paths.len; i++) {
+        bytes += entry_bytes(paths.items[i]);
+    }
+
+    pthread_rwlock_wrlock(&index_lock);
+    entry_list_t old_paths = by_path;
+    entry_list_t old_names = by_name;
+    entry_list_t old_suffixes = by_suffix;
+    by_path = paths;
+    by_name = names;
+    by_suffix = suffixes;
+    state = INDEX_READY;
+    stats.entries = paths.len;
+    stats.bytes = bytes;
+    stats.rebuilds++;
+    stats.unwatched = unwatched;
+    pthread_rwlock_unlock(&index_lock);
+
+    free_entries(&old_paths);
+    free(old_names.items);
+    free(old_suffixes.items);
+}
+
+/**
+ * Ensures list has room for count more entries without reallocating
+ *
+ * @return 1 on success; else 0 and list is unchanged
+ */
+static int reserve_entries(entry_list_t *list, size_t count) {
+    if (list->len + count <= list->capacity) {
+        return 1;
+    }
+    size_t capacity = list->capacity > 0 ? list->capacity : 1024;
+    while (capacity < list->len + count) {
+        capacity *= 2;
+    }
+    nameindex_entry_t **items = realloc(list->items, capacity * sizeof(nameindex_entry_t *));
+    if (items == NULL) {
+        return 0;
+    }
+    list->items = items;
+    list->capacity = capacity;
+    return 1;
+}
+
+/**
+ * Deletes entries of removes, sorted by compare, from list in place. Each
+ * is found with a binary search and only the entries after the first one
+ * move; no entry is dereferenced outside of the searches.
+ */
+static void remove_entries(entry_list_t *list, const entry_list_t *removes,
+                           int (*compare)(const void *, const void *)) {
+    size_t write = 0, read = 0;
+    for (size_t j = 0; j < removes->len; j++) {
+        size_t i = range_lower_bound(list, read, list->len, removes->items[j], compare);
+        if (i == list->len || list->items[i] != removes->items[j]) {
+            continue;
+        }
+        if (write != read) {
+            memmove(&list->items[write], &list->items[read], (i - read) * sizeof(nameindex_entry_t *));
+        }
+        write += i - read;
+        read = i + 1;
+    }
+    if (write != read) {
+        memmove(&list->items[write], &list->items[read], (list->len - read) * sizeof(nameindex_entry_t *));
+    }
+    list->len -= read - write;
+}
+
+/**
+ * Inserts adds, sorted by compare, into list in place, from the back so
+ * each entry moves at most once. list must have room for them.
+ */
+static void insert_entries(entry_list_t *list, const entry_list_t *adds,
+                           int (*compare)(const void *, const void *)) {
+    size_t read = list->len, write = list->len + adds->len;
+    for (size_t j = adds->len; j > 0; j--) {
+        size_t i = range_lower_bound(list, 0, read, adds->items[j - 1], compare);
+        write -= read - i;
+        memmove(&list->items[write], &list->items[i], (read - i) * sizeof(nameindex_entry_t *));
+        read = i;
+        list->items[--write] = adds->items[j - 1];
+    }
+    list->len += adds->len;
+}
+
+static int compare_string(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/**
+ * @return 1 if a proper ancestor of path is in sorted paths; else 0
+ */
+static int has_ancestor(char **paths, size_t len, const char *path) {
+    char ancestor[PATH_MAX];
+    for (const char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        memcpy(ancestor, path, slash - path);
+        ancestor[slash - path] = '\0';
+        char *key = ancestor;
+        if (bsearch(&key, paths, len, sizeof(char *), compare_string) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void request_rebuild() {
+    pthread_mutex_lock(&pending_lock);
+    rebuild_pending = 1;
+    pthread_mutex_unlock(&pending_lock);
+}
+
+/**
+ * Adds the entry at path, and every entry below it, to removed. Both are
+ * found with a binary search on by_path. Caller holds index_lock.
+ *
+ * @return 1 on success; else 0
+ */
+static int collect_removed(const char *path, entry_list_t *removed) {
+    size_t i = path_lower_bound(path);
+    if (i < by_path.len && strcmp(by_path.items[i]->path, path) == 0 && !push_entry(removed, by_path.items[i])) {
+        return 0;
+    }
+    char prefix[PATH_MAX];
+    int prefix_len = snprintf(prefix, PATH_MAX, "%s/", path);
+    for (i = path_lower_bound(prefix); i < by_path.len; i++) {
+        if (strncmp(by_path.items[i]->path, prefix, prefix_len) != 0) {
+            break;
+        }
+        if (!push_entry(removed, by_path.items[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Copies list and sorts the copy by compare
+ *
+ * @return 1 on success; else 0
+ */
+static int sorted_copy(const entry_list_t *list, entry_list_t *copy, int (*compare)(const void *, const void *)) {
+    copy->items = malloc(list->len * sizeof(nameindex_entry_t *) + 1);
+    if (copy->items == NULL) {
+        return 0;
+    }
+    memcpy(copy->items, list->items, list->len * sizeof(nameindex_entry_t *));
+    copy->len = copy->capacity = list->len;
+    qsort(copy->items, copy->len, sizeof(nameindex_entry_t *), compare);
+    return 1;
+}
+
+/**
+ * Rescans each changed path and replaces its entries, and those below it,
+ * by splicing them in place into each array
+ *
+ * @param changes changed relative paths; freed
+ * @param count number of changes
+ */
+static void apply_changes(pending_path_t *changes, int count) {
+    char **paths = malloc(count * sizeof(char *));
+    if (paths == NULL) {
+        free_pending(changes);
+        request_rebuild();
+        return;
+    }
+    int len = 0;
+    for (pending_path_t *change = changes; change != NULL; change = change->next) {
+        paths[len++] = change->path;
+    }
+    qsort(paths, len, sizeof(char *), compare_string);
+    int unique = 0;
+    for (int i = 0; i < len; i++) {
+        if (unique == 0 || strcmp(paths[unique - 1], paths[i]) != 0) {
+            paths[unique++] = paths[i];
+        }
+    }
+
+    // Scan outside the lock; paths below another changed path are covered
+    // by the scan of that path
+    int roots = 0;
+    unsigned long unwatched = 0;
+    entry_list_t adds = {0};
+    for (int i = 0; i < unique; i++) {
+        if (!has_ancestor(paths, unique, paths[i])) {
+            paths[roots++] = paths[i];
+            scan_path(&adds, paths[i], &unwatched);
+        }
+    }
+    qsort(adds.items, adds.len, sizeof(nameindex_entry_t *), compare_path);
+    entry_list_t adds_by_name = {0};
+    entry_list_t adds_by_suffix = {0};
+    int merged = sorted_copy(&adds, &adds_by_name, compare_name) &&
+                 sorted_copy(&adds, &adds_by_suffix, compare_suffix);
+
+    // Only the changed ranges are looked up, and the arrays are spliced in
+    // place, so a batch costs its own size plus moving pointers, not a pass
+    // over every entry
+    entry_list_t removed = {0};
+    entry_list_t removed_by_name = {0};
+    entry_list_t removed_by_suffix = {0};
+    pthread_rwlock_wrlock(&index_lock);
+    for (int i = 0; i < roots && merged; i++) {
+        merged = collect_removed(paths[i], &removed);
+    }
+    if (merged) {
+        qsort(removed.items, removed.len, sizeof(nameindex_entry_t *), compare_path);
+        merged = sorted_copy(&removed, &removed_by_name, compare_name) &&
+                 sorted_copy(&removed, &removed_by_suffix, compare_suffix) &&
+                 reserve_entries(&by_path, adds.len) && reserve_entries(&by_name, adds.len) &&
+                 reserve_entries(&by_suffix, adds.len);
+    }
+    if (merged) {
+        remove_entries(&by_path, &removed, compare_path);
+        insert_entries(&by_path, &adds, compare_path);
+        remove_entries(&by_name, &removed_by_name, compare_name);
+        insert_entries(&by_name, &adds_by_name, compare_name);
+        remove_entries(&by_suffix, &removed_by_suffix, compare_suffix);
+        insert_entries(&by_suffix, &adds_by_suffix, compare_suffix);
+        for (size_t i = 0; i < adds.len; i++) {
+            stats.bytes += entry_bytes(adds.items[i]);
+        }
+        for (size_t i = 0; i < removed.len; i++) {
+            stats.bytes -= entry_bytes(removed.items[i]);
+        }
+        stats.entries = by_path.len;
+        stats.updates += roots;
+        stats.unwatched += unwatched;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    if (merged) {
+        free_entries(&removed);
+        free(adds.items);
+    } else {
+        // Out of memory: start over from a full scan
+        free(removed.items);
+        free_entries(&adds);
+        request_rebuild();
+    }
+    free(removed_by_name.items);
+    free(removed_by_suffix.items);
+    free(adds_by_name.items);
+    free(adds_by_suffix.items);
+    free(paths);
+    free_pending(changes);
+}
+
+/**
+ * Index thread: builds the index, then applies queued changes in batches
+ *
+ * @param arg unused
+ * @return NULL
+ */
+static void *run_index(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&pending_lock);
+        while (!rebuild_pending && pending == NULL) {
+            pthread_cond_wait(&pending_cond, &pending_lock);
+        }
+        int full = rebuild_pending;
+        pending_path_t *changes = pending;
+        int count = num_pending;
+        rebuild_pending = 0;
+        pending = NULL;
+        num_pending = 0;
+        pthread_mutex_unlock(&pending_lock);
+
+        if (full) {
+            // Changes queued so far are covered by the rescan
+            free_pending(changes);
+            rebuild();
+        } else {
+            apply_changes(changes, count);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * fswatch listener queueing paths whose entry was added or removed
+ */
+static void on_change(const char *dirpath, const char *name, uint32_t mask) {
+    pending_path_t *change = NULL;
+    if (dirpath != NULL) {
+        if (name == NULL || !(mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+            return;
+        }
+        if (strncmp(dirpath, root, root_len) != 0 || (dirpath[root_len] != '/' && dirpath[root_len] != '\0')) {
+            return;
+        }
+        const char *reldir = dirpath + root_len;
+        change = malloc(sizeof(pending_path_t) + strlen(reldir) + strlen(name) + 2);
+        if (change != NULL) {
+            sprintf(change->path, "%s/%s", reldir, name);
+        }
+    }
+
+    pthread_mutex_lock(&pending_lock);
+    if (change == NULL || num_pending == NAMEINDEX_MAX_PENDING) {
+        // Events were lost or are piling up: rescan everything instead
+        free_pending(pending);
+        pending = NULL;
+        num_pending = 0;
+        rebuild_pending = 1;
+        free(change);
+    } else {
+        change->next = pending;
+        pending = change;
+        num_pending++;
+    }
+    pthread_cond_signal(&pending_cond);
+    pthread_mutex_unlock(&pending_lock);
+}
+
+/**
+ * Subscribes to filesystem changes and starts building the index of
+ * rootpath in the background
+ *
+ * @param rootpath served root directory
+ * @return 1 if the index is being built; else 0
+ */
+int nameindex_init(const char *rootpath) {
+    if (realpath(rootpath, root) == NULL) {
+        return 0;
+    }
+    if (strcmp(root, "/") == 0) {
+        root[0] = '\0';
+    }
+    root_len = strlen(root);
+    if (!fswatch_listen(on_change)) {
+        return 0;
+    }
+    rebuild_pending = 1;
+    state = INDEX_BUILDING;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, NAMEINDEX_STACK_SIZE);
+    int status = pthread_create(&index_thread, &attr, run_index, NULL);
+    pthread_attr_destroy(&attr);
+    if (status != 0) {
+        state = INDEX_OFF;
+        return 0;
+    }
+    return 1;
+}
+
+nameindex_state_t nameindex_state() {
+    pthread_rwlock_rdlock(&index_lock);
+    nameindex_state_t current = state;
+    pthread_rwlock_unlock(&index_lock);
+    return current;
+}
+
+typedef enum {
+    FIND_BY_PATH,    // glob with "/", matched against paths with its prefix
+    FIND_BY_NAME,    // glob matched against names with its prefix
+    FIND_BY_SUFFIX   // glob starting with a wildcard, matched against names with its suffix
+} find_order_t;
+
+typedef struct find_query_s {
+    find_order_t order;
+    char pattern[PATH_MAX];
+    char literal[PATH_MAX];  // prefix, or suffix for FIND_BY_SUFFIX
+    size_t literal_len;
+    const char *dirpath;
+    size_t dir_len;
+} find_query_t;
+
+static const entry_list_t *query_list(const find_query_t *query, int (**compare)(const void *, const void *)) {
+    switch (query->order) {
+    case FIND_BY_PATH:
+        *compare = compare_path;
+        return &by_path;
+    case FIND_BY_NAME:
+        *compare = compare_name;
+        return &by_name;
+    default:
+        *compare = compare_suffix;
+        return &by_suffix;
+    }
+}
+
+/**
+ * @return 1 if entry is in the range of the query's list that can match
+ */
+static int in_range(const find_query_t *query, const nameindex_entry_t *entry) {
+    if (query->order == FIND_BY_PATH) {
+        return strncmp(entry->path, query->literal, query->literal_len) == 0;
+    }
+    const char *name = entry_name(entry);
+    if (query->order == FIND_BY_NAME) {
+        return strncmp(name, query->literal, query->literal_len) == 0;
+    }
+    size_t name_len = strlen(name);
+    return name_len >= query->literal_len &&
+           memcmp(name + name_len - query->literal_len, query->literal, query->literal_len) == 0;
+}
+
+static int is_match(const find_query_t *query, const nameindex_entry_t *entry) {
+    if (query->order == FIND_BY_PATH) {
+        return fnmatch(query->pattern, entry->path, FNM_PATHNAME) == 0;
+    }
+    return strncmp(entry->path, query->dirpath, query->dir_len) == 0 && entry->path[query->dir_len] == '/' &&
+           fnmatch(query->pattern, entry_name(entry), 0) == 0;
+}
+
+/**
+ * Copies the next batch of matches into batch, starting after the entry at
+ * path last, or at the start of the range if last is empty. Stops after
+ * NAMEINDEX_BATCH_ENTRIES entries or before batch could overflow, so the
+ * read lock is held for a bounded time. Caller holds index_lock for reading.
+ *
+ * @param last path of the last entry examined; updated
+ * @param batch output buffer of NAMEINDEX_BATCH_SIZE bytes
+ * @param len return bytes in batch
+ * @param count incremented for each match
+ * @return 1 if the range was exhausted; else 0
+ */
+static int find_batch(const find_query_t *query, char last[PATH_MAX], char *batch, size_t *len, int *count) {
+    int (*compare)(const void *, const void *);
+    const entry_list_t *list = query_list(query, &compare);
+    size_t i;
+    if (last[0] == '\0') {
+        i = query->order == FIND_BY_PATH   ? path_lower_bound(query->literal)
+            : query->order == FIND_BY_NAME ? name_lower_bound(query->literal)
+                                           : suffix_lower_bound(query->literal);
+    } else {
+        // The index may have changed since the last batch; resume by key
+        char key_data[sizeof(nameindex_entry_t) + PATH_MAX];
+        nameindex_entry_t *key = (nameindex_entry_t *)key_data;
+        strcpy(key->path, last);
+        key->name_offset = strrchr(key->path, '/') + 1 - key->path;
+        i = entry_lower_bound(list, key, compare);
+        if (i < list->len && strcmp(list->items[i]->path, last) == 0) {
+            i++;
+        }
+    }
+    *len = 0;
+    for (int scanned = 0; scanned < NAMEINDEX_BATCH_ENTRIES; scanned++, i++) {
+        if (i >= list->len || !in_range(query, list->items[i])) {
+            return 1;
+        }
+        const char *path = list->items[i]->path;
+        size_t path_len = strlen(path);
+        if (*len + path_len + 2 > NAMEINDEX_BATCH_SIZE) {
+            break;
+        }
+        strcpy(last, path);
+        if (is_match(query, list->items[i])) {
+            memcpy(batch + *len, path, path_len);
+            memcpy(batch + *len + path_len, "\r\n", 2);
+            *len += path_len + 2;
+            (*count)++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Sends the paths below dirpath matching glob to outfd, one per line. A
+ * glob without "/" is matched against file names; else against paths,
+ * relative to dirpath unless it starts with "/". Matches are sent in
+ * batches as they are found.
+ *
+ * @param outfd output fd
+ * @param dirpath directory relative to the root: "" or starting with "/"
+ * @param glob fnmatch pattern
+ * @return number of paths sent; -1 on failure
+ */
+int nameindex_find(int outfd, const char *dirpath, const char *glob) {
+    find_query_t *query = malloc(sizeof(find_query_t));
+    char *batch = malloc(NAMEINDEX_BATCH_SIZE);
+    if (query == NULL || batch == NULL) {
+        free(query);
+        free(batch);
+        return -1;
+    }
+    int by_glob_path = strchr(glob, '/') != NULL;
+    int too_long;
+    if (!by_glob_path || glob[0] == '/') {
+        too_long = snprintf(query->pattern, PATH_MAX, "%s", glob) >= PATH_MAX;
+    } else {
+        too_long = snprintf(query->pattern, PATH_MAX, "%s/%s", dirpath, glob) >= PATH_MAX;
+    }
+    // Every match starts with the characters before the first wildcard and,
+    // for names, ends with those after the last
+    size_t prefix_len = strcspn(query->pattern, "*?[\\");
+    size_t pattern_len = strlen(query->pattern);
+    size_t suffix_start = pattern_len;
+    while (suffix_start > 0 && strchr("*?[]\\", query->pattern[suffix_start - 1]) == NULL) {
+        suffix_start--;
+    }
+    query->order = by_glob_path ? FIND_BY_PATH : prefix_len > 0 || suffix_start == pattern_len ? FIND_BY_NAME
+                                                                                               : FIND_BY_SUFFIX;
+    if (query->order == FIND_BY_SUFFIX) {
+        query->literal_len = pattern_len - suffix_start;
+        memcpy(query->literal, query->pattern + suffix_start, query->literal_len);
+    } else {
+        query->literal_len = prefix_len;
+        memcpy(query->literal, query->pattern, prefix_len);
+    }
+    query->literal[query->literal_len] = '\0';
+    query->dirpath = dirpath;
+    query->dir_len = strlen(dirpath);
+
+    char last[PATH_MAX] = "";
+    int count = 0;
+    int done = too_long;
+    while (!done) {
+        size_t len;
+        pthread_rwlock_rdlock(&index_lock);
+        done = find_batch(query, last, batch, &len, &count);
+        pthread_rwlock_unlock(&index_lock);
+        if (len > 0 && write_all(outfd, batch, len) == -1) {
+            count = -1;
+            break;
+        }
+    }
+    free(query);
+    free(batch);
+    return count;
+}
+
+/**
+ * Copies a snapshot of index counters into out
+ *
+ * @param out return stats
+ */
+void nameindex_get_stats(nameindex_stats_t *out) {
+    pthread_rwlock_rdlock(&index_lock);
+    *out = stats;
+    pthread_rwlock_unlock(&index_lock);
+}
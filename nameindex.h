@@ -0,0 +1,33 @@
+#ifndef __NAMEINDEX_H__
+#define __NAMEINDEX_H__
+
+#include <stddef.h>
+
+#define NAMEINDEX_STACK_SIZE (256 * 1024)  // holds a few PATH_MAX buffers
+#define NAMEINDEX_MAX_PENDING 65536        // queued changes before a full rebuild
+#define NAMEINDEX_BATCH_SIZE (64 * 1024)   // bytes of matches sent per batch
+#define NAMEINDEX_BATCH_ENTRIES 4096       // entries examined per read lock hold
+
+typedef enum {
+    INDEX_OFF,
+    INDEX_BUILDING,
+    INDEX_READY
+} nameindex_state_t;
+
+typedef struct nameindex_stats_s {
+    size_t entries;
+    size_t bytes;
+    unsigned long updates;   // changed paths applied to the index
+    unsigned long rebuilds;  // full scans, including the first
+    unsigned long unwatched; // directories inotify could not watch
+} nameindex_stats_t;
+
+int nameindex_init(const char *rootpath);
+
+nameindex_state_t nameindex_state();
+
+int nameindex_find(int outfd, const char *dirpath, const char *glob);
+
+void nameindex_get_stats(nameindex_stats_t *stats);
+
+#endif
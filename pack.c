@@ -0,0 +1,247 @@
+/**
+ * @file pack.c
+ * Read-only storage backend serving a packed image built by mkpack
+ *
+ * The whole image is mapped, so resolving a path is a binary search over
+ * the sorted index without any syscalls, and file contents are sent with
+ * sendfile from the one pack fd. The pack replaces the whole namespace:
+ * root_directory is empty and canonical paths are the '/'-prefixed pack
+ * paths, with "" for the root. Paths are resolved lexically since a pack
+ * has no symlinks.
+ *
+ * Public functions:
+ * - pack_open
+ *
+ * Public variables:
+ * - pack_storage
+ *
+ */
+
+#include "pack.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "transfer.h"
+
+static int pack_fd = -1;
+static const char *pack_base;
+static struct stat pack_st;
+static const pack_header_t *header;
+static const pack_entry_t *entries;
+static const char *names;
+
+static const char *entry_name(const pack_entry_t *entry) {
+    return names + entry->name_offset;
+}
+
+/**
+ * Checks that all offsets of the mapped image are in bounds and that the
+ * index is sorted, so lookups can trust the image afterwards
+ *
+ * @return 1 if the image is valid; else 0
+ */
+static int validate_pack(size_t len) {
+    if (len < sizeof(pack_header_t) || memcmp(header->magic, PACK_MAGIC, PACK_MAGIC_LEN) != 0 ||
+        header->version != PACK_VERSION) {
+        return 0;
+    }
+    uint64_t index_end = sizeof(pack_header_t) + (uint64_t)header->num_entries * sizeof(pack_entry_t);
+    if (index_end > header->names_offset || header->names_offset > header->data_offset ||
+        header->data_offset > len) {
+        return 0;
+    }
+    uint64_t names_len = header->data_offset - header->names_offset;
+    for (uint32_t i = 0; i < header->num_entries; i++) {
+        const pack_entry_t *entry = &entries[i];
+        if (entry->name_offset >= names_len || entry->name_len >= PACK_PATH_LEN ||
+            entry->name_len >= names_len - entry->name_offset ||
+            names[entry->name_offset + entry->name_len] != '\0' ||
+            entry->offset > len || entry->size > len - entry->offset) {
+            return 0;
+        }
+        if (i > 0 && strcmp(entry_name(&entries[i - 1]), entry_name(entry)) >= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Maps the pack image at path for serving
+ *
+ * @param path pack image built by mkpack
+ * @return 1 on success; else 0
+ */
+int pack_open(const char *path) {
+    pack_fd = open(path, O_RDONLY);
+    if (pack_fd == -1 || fstat(pack_fd, &pack_st) == -1 || pack_st.st_size == 0) {
+        return 0;
+    }
+    void *base = mmap(NULL, pack_st.st_size, PROT_READ, MAP_SHARED, pack_fd, 0);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    pack_base = base;
+    header = base;
+    entries = (const pack_entry_t *)(pack_base + sizeof(pack_header_t));
+    names = pack_base + (pack_st.st_size >= (off_t)sizeof(pack_header_t) ? header->names_offset : 0);
+    if (!validate_pack(pack_st.st_size)) {
+        munmap(base, pack_st.st_size);
+        return 0;
+    }
+    // Keep the index resident; contents are read on demand
+    madvise(base, header->data_offset, MADV_WILLNEED);
+    return 1;
+}
+
+/**
+ * @return index of the first entry not less than key; num_entries if none
+ */
+static uint32_t lower_bound(const char *key) {
+    uint32_t lo = 0;
+    uint32_t hi = header->num_entries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(entry_name(&entries[mid]), key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @return entry of canonical path; NULL for the root or a missing path
+ */
+static const pack_entry_t *find_entry(const char *path) {
+    const char *key = path[0] == '/' ? path + 1 : path;
+    uint32_t i = lower_bound(key);
+    if (i < header->num_entries && strcmp(entry_name(&entries[i]), key) == 0) {
+        return &entries[i];
+    }
+    return NULL;
+}
+
+/**
+ * Collapses repeated separators and "." and ".." components of path
+ */
+static void pack_canonicalize(const char *path, char outpath[]) {
+    size_t len = 0;
+    while (*path != '\0') {
+        size_t component_len = strcspn(path, "/");
+        if (component_len == 2 && strncmp(path, "..", 2) == 0) {
+            while (len > 0 && outpath[--len] != '/') {
+            }
+        } else if (component_len > 0 && !(component_len == 1 && path[0] == '.')) {
+            outpath[len++] = '/';
+            memcpy(outpath + len, path, component_len);
+            len += component_len;
+        }
+        path += component_len;
+        if (*path == '/') {
+            path++;
+        }
+    }
+    outpath[len] = '\0';
+}
+
+static int pack_stat(const char *path, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = pack_st.st_dev;
+    st->st_nlink = 1;
+    st->st_blksize = pack_st.st_blksize;
+    if (path[0] == '\0' || strcmp(path, "/") == 0) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_mtime = pack_st.st_mtime;
+        return 0;
+    }
+    const pack_entry_t *entry = find_entry(path);
+    if (entry == NULL) {
+        return -1;
+    }
+    st->st_ino = entry - entries + 1;
+    st->st_mode = entry->mode;
+    st->st_size = entry->size;
+    st->st_mtime = entry->mtime;
+    st->st_blocks = (entry->size + 511) / 512;
+    return 0;
+}
+
+static int pack_open_file(const char *path, storage_file_t *file, struct stat *st) {
+    if (pack_stat(path, st) == -1 || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+    file->fd = pack_fd;
+    file->offset = find_entry(path)->offset;
+    return 1;
+}
+
+static off_t pack_send(int outfd, storage_file_t *file, const char *path, off_t size, int ascii) {
+    if (ascii) {
+        return send_ascii_mapped(outfd, pack_base + file->offset, size);
+    }
+    return send_file_range(outfd, file->fd, file->offset, size);
+}
+
+static void pack_close(storage_file_t *file) {
+    file->fd = -1;  // the pack fd stays open
+}
+
+/**
+ * Writes the names of the direct children of dirpath, one per line. The
+ * contents of each subdirectory are skipped with a binary search.
+ *
+ * @return number of names written; -1 if dirpath is not a directory
+ */
+static int pack_list(int outfd, const char *dirpath) {
+    struct stat st;
+    if (pack_stat(dirpath, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+    char prefix[PACK_PATH_LEN + 2];
+    const char *key = dirpath[0] == '/' ? dirpath + 1 : dirpath;
+    size_t prefix_len = snprintf(prefix, sizeof(prefix), "%s%s", key, key[0] != '\0' ? "/" : "");
+
+    char buf[PACK_LIST_BUF_SIZE];
+    size_t len = snprintf(buf, sizeof(buf), ".\r\n..\r\n");
+    int count = 2;
+    uint32_t i = lower_bound(prefix);
+    while (i < header->num_entries && strncmp(entry_name(&entries[i]), prefix, prefix_len) == 0) {
+        const char *name = entry_name(&entries[i]) + prefix_len;
+        size_t name_len = strcspn(name, "/");
+        if (name[name_len] == '/') {
+            // '0' follows '/', so this is the first path after the subtree
+            char next[PACK_PATH_LEN + 2];
+            snprintf(next, sizeof(next), "%.*s%.*s0", (int)prefix_len, prefix, (int)name_len, name);
+            i = lower_bound(next);
+            continue;
+        }
+        if (len + name_len + 2 > sizeof(buf)) {
+            write(outfd, buf, len);
+            len = 0;
+        }
+        memcpy(buf + len, name, name_len);
+        memcpy(buf + len + name_len, "\r\n", 2);
+        len += name_len + 2;
+        count++;
+        i++;
+    }
+    write(outfd, buf, len);
+    return count;
+}
+
+const storage_t pack_storage = {
+    .name = "pack",
+    .canonicalize = pack_canonicalize,
+    .stat = pack_stat,
+    .open = pack_open_file,
+    .send = pack_send,
+    .close = pack_close,
+    .list = pack_list,
+    .send_tar = NULL,
+};
@@ -0,0 +1,42 @@
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include <stdint.h>
+
+#include "storage.h"
+
+#define PACK_MAGIC "JSFTPPK1"
+#define PACK_MAGIC_LEN 8
+#define PACK_VERSION 1
+#define PACK_PATH_LEN 1024  // longest packed path, including NUL
+#define PACK_LIST_BUF_SIZE 4096
+
+// Pack image layout, in host byte order:
+//   pack_header_t
+//   pack_entry_t[num_entries], sorted by path with strcmp
+//   path names, each NUL-terminated
+//   file contents, contiguous
+// Paths are relative to the packed root without a leading '/'; the root
+// itself has no entry.
+typedef struct pack_header_s {
+    char magic[PACK_MAGIC_LEN];
+    uint32_t version;
+    uint32_t num_entries;
+    uint64_t names_offset;
+    uint64_t data_offset;
+} pack_header_t;
+
+typedef struct pack_entry_s {
+    uint64_t name_offset;  // from names_offset
+    uint64_t offset;       // of contents from start of pack
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mode;
+    uint32_t name_len;
+} pack_entry_t;
+
+int pack_open(const char *path);
+
+extern const storage_t pack_storage;
+
+#endif
@@ -0,0 +1,626 @@
+/**
+ * @file replay.c
+ * Replays a session trace recorded with FTP_TRACE_FILE against a server
+ *
+ * Each traced session is replayed on its own thread at its recorded offset,
+ * divided by the speed factor, so the original concurrency is kept. Commands
+ * are sent at their recorded offsets or as soon as the previous reply
+ * arrives if the session has fallen behind. Per-command latencies are then
+ * reported against the latencies in the trace.
+ *
+ * Usage: replay [-h host] [-p port] [-s speed] [-o out.trace] trace
+ *
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "2121"
+#define MIN_SPEED 1.0
+#define MAX_SPEED 100.0
+#define REPLY_TIMEOUT_SECONDS 60
+#define REPLY_LEN 1024
+#define CTRL_BUF_LEN 4096
+#define DATA_BUF_LEN (64 * 1024)
+#define VERB_LEN 16
+
+typedef struct replay_cmd_s {
+    char *line;
+    uint64_t timestamp_us;
+    uint64_t recorded_us;
+    uint64_t recorded_bytes;
+    uint64_t replay_us;
+    uint64_t replay_bytes;
+    int code;  // final reply code; -1 if the connection failed
+} replay_cmd_t;
+
+typedef struct replay_session_s {
+    uint32_t pid;
+    uint32_t id;
+    uint64_t open_us;
+    replay_cmd_t *cmds;
+    int num_cmds;
+    int max_cmds;
+    pthread_t thread;
+} replay_session_t;
+
+typedef struct ctrl_conn_s {
+    int fd;
+    size_t start;
+    size_t end;
+    char buf[CTRL_BUF_LEN];
+} ctrl_conn_t;
+
+typedef struct verb_stats_s {
+    char verb[VERB_LEN];
+    int count;
+    int errors;
+    uint64_t recorded_us;
+    uint64_t *replay_us;
+} verb_stats_t;
+
+static const char *host = DEFAULT_HOST;
+static const char *port = DEFAULT_PORT;
+static double speed = MIN_SPEED;
+static uint64_t base_us;
+
+static replay_session_t *sessions;
+static int num_sessions;
+
+static uint64_t monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Sleeps until the scaled replay time of a trace timestamp
+ */
+static void sleep_until(uint64_t timestamp_us) {
+    uint64_t target_us = base_us + (uint64_t)(timestamp_us / speed);
+    struct timespec target = {.tv_sec = target_us / 1000000, .tv_nsec = (target_us % 1000000) * 1000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR) {
+    }
+}
+
+/**
+ * Finds the position of a session in the session array, ordered by the
+ * writing process and then by id, since ids restart after a reload
+ *
+ * @param pid process that wrote the session
+ * @param id trace session id
+ * @param found return 1 if the session exists
+ * @return index of the session, or where it would be inserted
+ */
+static int find_session(uint32_t pid, uint32_t id, int *found) {
+    int lo = 0;
+    int hi = num_sessions;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (sessions[mid].pid < pid || (sessions[mid].pid == pid && sessions[mid].id < id)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = lo < num_sessions && sessions[lo].pid == pid && sessions[lo].id == id;
+    return lo;
+}
+
+/**
+ * Makes room for the command after the last one of session; transfer
+ * records are written before the command that ran them, so their bytes are
+ * held in that slot until the command record arrives
+ *
+ * @return 1 on success; else 0
+ */
+static int reserve_cmd(replay_session_t *session) {
+    if (session->num_cmds < session->max_cmds) {
+        return 1;
+    }
+    int max_cmds = session->max_cmds > 0 ? session->max_cmds * 2 : 16;
+    replay_cmd_t *cmds = realloc(session->cmds, max_cmds * sizeof(replay_cmd_t));
+    if (cmds == NULL) {
+        return 0;
+    }
+    memset(&cmds[session->max_cmds], 0, (max_cmds - session->max_cmds) * sizeof(replay_cmd_t));
+    session->cmds = cmds;
+    session->max_cmds = max_cmds;
+    return 1;
+}
+
+/**
+ * Groups the records of a trace into sessions ordered by process and id
+ *
+ * @return 1 on success; else 0
+ */
+static int load_trace(const char *path) {
+    FILE *file = trace_open_read(path);
+    if (file == NULL) {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        return 0;
+    }
+    trace_record_t record;
+    char payload[TRACE_MAX_PAYLOAD + 1];
+    int max_sessions = 0;
+    int ok = 1;
+    while (ok && trace_read(file, &record, payload)) {
+        int found;
+        int index = find_session(record.pid, record.session_id, &found);
+        if (record.type == TRACE_OPEN) {
+            if (found) {
+                continue;
+            }
+            if (num_sessions == max_sessions) {
+                max_sessions = max_sessions > 0 ? max_sessions * 2 : 64;
+                replay_session_t *grown = realloc(sessions, max_sessions * sizeof(replay_session_t));
+                if (grown == NULL) {
+                    ok = 0;
+                    break;
+                }
+                sessions = grown;
+            }
+            // Sessions open in nearly id order, so this rarely moves much
+            memmove(&sessions[index + 1], &sessions[index], (num_sessions - index) * sizeof(replay_session_t));
+            num_sessions++;
+            replay_session_t *session = &sessions[index];
+            memset(session, 0, sizeof(*session));
+            session->pid = record.pid;
+            session->id = record.session_id;
+            session->open_us = record.timestamp_us;
+            continue;
+        }
+        if (!found || (record.type != TRACE_COMMAND && record.type != TRACE_TRANSFER)) {
+            continue;
+        }
+        replay_session_t *session = &sessions[index];
+        if (!reserve_cmd(session)) {
+            ok = 0;
+            break;
+        }
+        replay_cmd_t *cmd = &session->cmds[session->num_cmds];
+        if (record.type == TRACE_TRANSFER) {
+            cmd->recorded_bytes += record.value;
+            continue;
+        }
+        cmd->line = strdup(payload);
+        cmd->timestamp_us = record.timestamp_us;
+        cmd->recorded_us = record.value;
+        ok = cmd->line != NULL;
+        session->num_cmds++;
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "Out of memory loading %s\n", path);
+    }
+    return ok;
+}
+
+/**
+ * Opens a TCP connection to host on the given port
+ *
+ * @return socket fd; -1 on failure
+ */
+static int connect_to(const char *port_str) {
+    struct addrinfo hints;
+    struct addrinfo *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port_str, &hints, &result) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd != -1) {
+        struct timeval timeout = {.tv_sec = REPLY_TIMEOUT_SECONDS};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    return fd;
+}
+
+/**
+ * Reads one line of a control connection without its line ending
+ *
+ * @return 1 if a line was read; 0 on EOF, error or timeout
+ */
+static int read_line(ctrl_conn_t *conn, char line[REPLY_LEN]) {
+    size_t len = 0;
+    while (1) {
+        if (conn->start == conn->end) {
+            ssize_t n = read(conn->fd, conn->buf, CTRL_BUF_LEN);
+            if (n <= 0) {
+                return 0;
+            }
+            conn->start = 0;
+            conn->end = n;
+        }
+        char chr = conn->buf[conn->start++];
+        if (chr == '\n') {
+            break;
+        }
+        if (chr != '\r' && chr != '\0' && len < REPLY_LEN - 1) {
+            line[len++] = chr;
+        }
+    }
+    line[len] = '\0';
+    return 1;
+}
+
+/**
+ * Reads a complete reply, including all lines of a multiline reply
+ *
+ * @param conn control connection
+ * @param line return first line of the reply
+ * @return reply code; -1 if the connection failed
+ */
+static int read_reply(ctrl_conn_t *conn, char line[REPLY_LEN]) {
+    if (!read_line(conn, line) || strlen(line) < 3) {
+        return -1;
+    }
+    int code = atoi(line);
+    if (line[3] != '-') {
+        return code;
+    }
+    char next[REPLY_LEN];
+    do {
+        if (!read_line(conn, next)) {
+            return -1;
+        }
+    } while (!(strncmp(next, line, 3) == 0 && next[3] == ' '));
+    return code;
+}
+
+/**
+ * Connects to the data port of a 227 reply. The host in the reply is
+ * ignored, as the server reports its external address.
+ *
+ * @return socket fd; -1 on failure
+ */
+static int open_passive_data(const char *reply) {
+    const char *numbers = strchr(reply, '(');
+    int h1, h2, h3, h4, p1, p2;
+    if (numbers == NULL || sscanf(numbers, "(%d,%d,%d,%d,%d,%d)", &h1, &h2, &h3, &h4, &p1, &p2) != 6) {
+        return -1;
+    }
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%d", p1 * 256 + p2);
+    return connect_to(port_str);
+}
+
+/**
+ * Gets the verb a command is reported under, including the subcommand of
+ * SITE
+ */
+static void get_verb(const char *line, char verb[VERB_LEN]) {
+    size_t len = 0;
+    int words = strncasecmp(line, "SITE ", 5) == 0 ? 2 : 1;
+    for (const char *chr = line; *chr != '\0' && len < VERB_LEN - 1; chr++) {
+        if (*chr == ' ' && --words == 0) {
+            break;
+        }
+        verb[len++] = toupper((unsigned char)*chr);
+    }
+    verb[len] = '\0';
+}
+
+static int is_transfer(const char *verb) {
+    return strcmp(verb, "RETR") == 0 || strcmp(verb, "NLST") == 0 ||
+           strcmp(verb, "LIST") == 0 || strcmp(verb, "SITE TAR") == 0;
+}
+
+/**
+ * Runs one command on a control connection
+ *
+ * @param conn control connection
+ * @param line command to send
+ * @param datafd data connection opened by a previous PASV; set by PASV
+ * @param buf data connection buffer
+ * @param bytes return file bytes received by RETR
+ * @return final reply code; -1 if the connection failed
+ */
+static int run_cmd(ctrl_conn_t *conn, const char *line, int *datafd, char *buf, uint64_t *bytes) {
+    char verb[VERB_LEN];
+    char reply[REPLY_LEN];
+    get_verb(line, verb);
+    if (dprintf(conn->fd, "%s\r\n", line) < 0) {
+        return -1;
+    }
+    int code = read_reply(conn, reply);
+    if (strcmp(verb, "PASV") == 0 && code == 227) {
+        if (*datafd != -1) {
+            close(*datafd);
+        }
+        *datafd = open_passive_data(reply);
+    } else if (is_transfer(verb) && *datafd != -1) {
+        if (code >= 100 && code < 200) {
+            ssize_t n;
+            while ((n = read(*datafd, buf, DATA_BUF_LEN)) > 0) {
+                if (strcmp(verb, "RETR") == 0) {  // the server traces file bytes only
+                    *bytes += n;
+                }
+            }
+            code = read_reply(conn, reply);
+        }
+        close(*datafd);
+        *datafd = -1;
+    }
+    return code;
+}
+
+/**
+ * Replays the commands of one session; its output trace records keep the
+ * session id of the input trace
+ *
+ * @param session_data replay_session_t to replay
+ * @return NULL
+ */
+static void *replay_session(void *session_data) {
+    replay_session_t *session = session_data;
+    ctrl_conn_t *conn = malloc(sizeof(ctrl_conn_t));
+    char *buf = malloc(DATA_BUF_LEN);
+    char reply[REPLY_LEN];
+    int i = 0;
+    if (conn == NULL || buf == NULL) {
+        goto fail;
+    }
+    sleep_until(session->open_us);
+    conn->start = 0;
+    conn->end = 0;
+    conn->fd = connect_to(port);
+    if (conn->fd == -1) {
+        goto fail;
+    }
+    if (read_reply(conn, reply) != 220) {
+        close(conn->fd);
+        goto fail;
+    }
+    // Sessions of several server processes may share an id; renumber them
+    uint32_t trace_id = (uint32_t)(session - sessions) + 1;
+    trace_write(trace_id, TRACE_OPEN, trace_now_us(), 0, NULL, 0);
+
+    int datafd = -1;
+    for (; i < session->num_cmds; i++) {
+        replay_cmd_t *cmd = &session->cmds[i];
+        char verb[VERB_LEN];
+        get_verb(cmd->line, verb);
+        // Active mode needs a listening client; replay it as passive.
+        // A plaintext replay cannot follow a TLS upgrade.
+        const char *line = strcmp(verb, "PORT") == 0 ? "PASV" : cmd->line;
+        if (strcmp(verb, "AUTH") == 0 || strcmp(verb, "PBSZ") == 0 || strcmp(verb, "PROT") == 0) {
+            cmd->code = 0;
+            continue;
+        }
+        sleep_until(cmd->timestamp_us);
+        uint64_t start_us = monotonic_us();
+        cmd->code = run_cmd(conn, line, &datafd, buf, &cmd->replay_bytes);
+        cmd->replay_us = monotonic_us() - start_us;
+        if (cmd->replay_bytes > 0) {
+            trace_write(trace_id, TRACE_TRANSFER, trace_now_us(), cmd->replay_bytes, NULL, 0);
+        }
+        trace_write(trace_id, TRACE_COMMAND, trace_now_us() - cmd->replay_us, cmd->replay_us,
+                    line, strlen(line));
+        if (cmd->code == -1) {
+            i++;
+            break;
+        }
+    }
+    if (datafd != -1) {
+        close(datafd);
+    }
+    close(conn->fd);
+    trace_write(trace_id, TRACE_CLOSE, trace_now_us(), 0, NULL, 0);
+
+fail:
+    // Commands that were never sent count as failed
+    for (; i < session->num_cmds; i++) {
+        session->cmds[i].code = -1;
+    }
+    free(conn);
+    free(buf);
+    return NULL;
+}
+
+static int compare_us(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double to_ms(uint64_t us) {
+    return us / 1000.0;
+}
+
+/**
+ * Prints replay latency per verb against the recorded latency
+ */
+static void print_report(uint64_t trace_us, uint64_t elapsed_us) {
+    verb_stats_t *stats = NULL;
+    int num_verbs = 0;
+    int total_cmds = 0;
+    for (int s = 0; s < num_sessions; s++) {
+        total_cmds += sessions[s].num_cmds;
+    }
+    stats = calloc(total_cmds > 0 ? total_cmds : 1, sizeof(verb_stats_t));
+    if (stats == NULL) {
+        return;
+    }
+
+    int failed = 0;
+    uint64_t recorded_bytes = 0;
+    uint64_t replay_bytes = 0;
+    for (int s = 0; s < num_sessions; s++) {
+        for (int c = 0; c < sessions[s].num_cmds; c++) {
+            replay_cmd_t *cmd = &sessions[s].cmds[c];
+            recorded_bytes += cmd->recorded_bytes;
+            replay_bytes += cmd->replay_bytes;
+            if (cmd->code == 0) {
+                continue;
+            }
+            if (cmd->code == -1) {
+                failed++;
+                continue;
+            }
+            char verb[VERB_LEN];
+            get_verb(cmd->line, verb);
+            int v;
+            for (v = 0; v < num_verbs && strcmp(stats[v].verb, verb) != 0; v++) {
+            }
+            if (v == num_verbs) {
+                strcpy(stats[v].verb, verb);
+                stats[v].replay_us = malloc(total_cmds * sizeof(uint64_t));
+                if (stats[v].replay_us == NULL) {
+                    continue;
+                }
+                num_verbs++;
+            }
+            stats[v].replay_us[stats[v].count++] = cmd->replay_us;
+            stats[v].recorded_us += cmd->recorded_us;
+            if (cmd->code >= 400) {
+                stats[v].errors++;
+            }
+        }
+    }
+
+    printf("%-10s %7s %7s %12s %12s %10s %10s %8s\n",
+           "command", "count", "4xx/5xx", "recorded_ms", "replay_ms", "p50_ms", "p99_ms", "delta");
+    for (int v = 0; v < num_verbs; v++) {
+        verb_stats_t *verb = &stats[v];
+        uint64_t sum = 0;
+        qsort(verb->replay_us, verb->count, sizeof(uint64_t), compare_us);
+        for (int i = 0; i < verb->count; i++) {
+            sum += verb->replay_us[i];
+        }
+        double recorded = to_ms(verb->recorded_us) / verb->count;
+        double replayed = to_ms(sum) / verb->count;
+        printf("%-10s %7d %7d %12.3f %12.3f %10.3f %10.3f %+7.1f%%\n",
+               verb->verb, verb->count, verb->errors, recorded, replayed,
+               to_ms(verb->replay_us[verb->count / 2]),
+               to_ms(verb->replay_us[(verb->count - 1) * 99 / 100]),
+               recorded > 0 ? (replayed - recorded) * 100 / recorded : 0.0);
+        free(verb->replay_us);
+    }
+    free(stats);
+
+    printf("\n%d sessions, %d commands, %d not completed\n", num_sessions, total_cmds, failed);
+    printf("transferred %llu bytes (recorded %llu)\n",
+           (unsigned long long)replay_bytes, (unsigned long long)recorded_bytes);
+    printf("replayed %.3f s of trace in %.3f s at %gx\n",
+           trace_us / 1e6, elapsed_us / 1e6, speed);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-s speed] [-o out.trace] trace\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *out_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:s:o:")) != -1) {
+        switch (opt) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!(speed >= MIN_SPEED && speed <= MAX_SPEED)) {
+        fprintf(stderr, "Speed must be between %g and %g\n", MIN_SPEED, MAX_SPEED);
+        return 1;
+    }
+    if (!load_trace(argv[optind])) {
+        return 1;
+    }
+    // The output trace records the replay so it can serve as a baseline;
+    // trace_open appends, so start it afresh
+    if (out_path != NULL && ((unlink(out_path) == -1 && errno != ENOENT) || !trace_open(out_path))) {
+        fprintf(stderr, "Could not open %s\n", out_path);
+        return 1;
+    }
+
+    uint64_t trace_us = 0;
+    for (int s = 0; s < num_sessions; s++) {
+        replay_cmd_t *last = sessions[s].num_cmds > 0 ? &sessions[s].cmds[sessions[s].num_cmds - 1] : NULL;
+        if (last != NULL && last->timestamp_us + last->recorded_us > trace_us) {
+            trace_us = last->timestamp_us + last->recorded_us;
+        }
+    }
+    // Start from the first session rather than from when the server started
+    uint64_t first_us = num_sessions > 0 ? sessions[0].open_us : 0;
+    for (int s = 1; s < num_sessions; s++) {
+        if (sessions[s].open_us < first_us) {
+            first_us = sessions[s].open_us;
+        }
+    }
+    trace_us -= trace_us > first_us ? first_us : trace_us;
+    base_us = monotonic_us() - (uint64_t)(first_us / speed);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    int started = 0;
+    for (; started < num_sessions; started++) {
+        if (pthread_create(&sessions[started].thread, &attr, replay_session, &sessions[started]) != 0) {
+            fprintf(stderr, "Could not start session %d of %d\n", started + 1, num_sessions);
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    for (int s = 0; s < started; s++) {
+        pthread_join(sessions[s].thread, NULL);
+    }
+    uint64_t elapsed_us = monotonic_us() - base_us - (uint64_t)(first_us / speed);
+    trace_close();
+
+    print_report(trace_us, elapsed_us);
+    for (int s = 0; s < num_sessions; s++) {
+        for (int c = 0; c < sessions[s].num_cmds; c++) {
+            free(sessions[s].cmds[c].line);
+        }
+        free(sessions[s].cmds);
+    }
+    free(sessions);
+    return started == num_sessions ? 0 : 1;
+}
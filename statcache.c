@@ -0,0 +1,304 @@
+/**
+ * @file statcache.c
+ * Sharded cache of file metadata keyed by resolved path
+ *
+ * Entries are only cached while their directory is watched by fswatch, and
+ * are dropped when inotify reports a change, so cached metadata stays
+ * coherent with the filesystem without revalidating on each lookup.
+ *
+ * Public functions:
+ * - statcache_init
+ * - statcache_stat
+ * - statcache_get_stats
+ *
+ */
+
+#include "statcache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fswatch.h"
+
+typedef struct statcache_entry_s {
+    struct statcache_entry_s *next;     // bucket chain
+    struct statcache_entry_s *lru_prev;
+    struct statcache_entry_s *lru_next;
+    unsigned int hash;
+    struct stat st;
+    char path[];
+} statcache_entry_t;
+
+typedef struct statcache_shard_s {
+    pthread_mutex_t lock;
+    statcache_entry_t *buckets[STATCACHE_BUCKETS];
+    statcache_entry_t *lru_head;  // most recently used
+    statcache_entry_t *lru_tail;
+    size_t num_entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;
+    // Bumped by every invalidation in the shard. A lookup only caches its
+    // stat result if no invalidation of its path happened since it missed,
+    // so a change racing with the stat call cannot leave a stale entry
+    // behind, while changes to other paths do not stop caching.
+    unsigned long generation;
+    unsigned long tree_generation;          // generation of the last tree invalidation
+    unsigned int recent[STATCACHE_RECENT];  // path hash of each recent generation
+} statcache_shard_t;
+
+static statcache_shard_t shards[STATCACHE_SHARDS];
+
+// FNV-1a
+static unsigned int hash_path(const char *path) {
+    unsigned int hash = 2166136261u;
+    for (; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    }
+    return hash;
+}
+
+static statcache_shard_t *to_shard(unsigned int hash) {
+    return &shards[hash % STATCACHE_SHARDS];
+}
+
+static statcache_entry_t **to_bucket(statcache_shard_t *shard, unsigned int hash) {
+    return &shard->buckets[(hash / STATCACHE_SHARDS) % STATCACHE_BUCKETS];
+}
+
+static void lru_unlink(statcache_shard_t *shard, statcache_entry_t *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push(statcache_shard_t *shard, statcache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+/**
+ * Unlinks entry from its shard and frees it. Shard lock must be held.
+ */
+static void remove_entry(statcache_shard_t *shard, statcache_entry_t *entry) {
+    statcache_entry_t **link = to_bucket(shard, entry->hash);
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    lru_unlink(shard, entry);
+    shard->num_entries--;
+    free(entry);
+}
+
+/**
+ * @return 1 if the entry of a path with hash may have been invalidated
+ *         since generation start; else 0. Shard lock must be held.
+ */
+static int changed_since(statcache_shard_t *shard, unsigned int hash, unsigned long start) {
+    if (shard->tree_generation > start || shard->generation - start > STATCACHE_RECENT) {
+        return 1;
+    }
+    for (unsigned long generation = start; generation < shard->generation; generation++) {
+        if (shard->recent[generation % STATCACHE_RECENT] == hash) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Drops the entry of path if cached
+ */
+static void invalidate_path(const char *path) {
+    unsigned int hash = hash_path(path);
+    statcache_shard_t *shard = to_shard(hash);
+    pthread_mutex_lock(&shard->lock);
+    shard->recent[shard->generation++ % STATCACHE_RECENT] = hash;
+    for (statcache_entry_t *entry = *to_bucket(shard, hash); entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            remove_entry(shard, entry);
+            shard->invalidations++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Drops the entries of dirpath and every path below it; every entry if
+ * dirpath is NULL
+ */
+static void invalidate_tree(const char *dirpath) {
+    size_t len = dirpath != NULL ? strlen(dirpath) : 0;
+    for (int i = 0; i < STATCACHE_SHARDS; i++) {
+        statcache_shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->tree_generation = ++shard->generation;
+        statcache_entry_t *entry = shard->lru_head;
+        while (entry != NULL) {
+            statcache_entry_t *next = entry->lru_next;
+            if (dirpath == NULL || (strncmp(entry->path, dirpath, len) == 0 &&
+                                    (entry->path[len] == '\0' || entry->path[len] == '/'))) {
+                remove_entry(shard, entry);
+                shard->invalidations++;
+            }
+            entry = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * fswatch listener dropping entries affected by a change
+ */
+static void on_change(const char *dirpath, const char *name, uint32_t mask) {
+    if (dirpath == NULL || name == NULL) {
+        invalidate_tree(dirpath);
+        return;
+    }
+    char *path = malloc(strlen(dirpath) + strlen(name) + 2);
+    if (path == NULL) {
+        invalidate_tree(dirpath);
+        return;
+    }
+    sprintf(path, "%s/%s", dirpath, name);
+    if ((mask & IN_ISDIR) && (mask & (IN_DELETE | IN_MOVED_FROM))) {
+        invalidate_tree(path);
+    } else {
+        invalidate_path(path);
+    }
+    // Adding or removing entries also changes the directory itself
+    if (mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+        invalidate_path(dirpath);
+    }
+    free(path);
+}
+
+/**
+ * Watches the directories whose events affect the metadata of path
+ *
+ * @return 1 if path is covered by watches; else 0
+ */
+static int watch_path(const char *path, const struct stat *st) {
+    if (S_ISDIR(st->st_mode) && !fswatch_add_dir(path)) {
+        return 0;
+    }
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || slash == path) {
+        return fswatch_add_dir("/");
+    }
+    char *dirpath = strndup(path, slash - path);
+    int watched = fswatch_add_dir(dirpath);
+    free(dirpath);
+    return watched;
+}
+
+/**
+ * Initializes shards and subscribes to filesystem changes
+ *
+ * @return 1 if entries can be cached; else 0 and lookups go to the filesystem
+ */
+int statcache_init() {
+    for (int i = 0; i < STATCACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    return fswatch_listen(on_change);
+}
+
+/**
+ * Gets metadata of path from the cache, falling back to stat on a miss
+ *
+ * @param path resolved absolute path
+ * @param st return metadata
+ * @return 0 on success; else -1 with errno set by stat
+ */
+int statcache_stat(const char *path, struct stat *st) {
+    unsigned int hash = hash_path(path);
+    statcache_shard_t *shard = to_shard(hash);
+    pthread_mutex_lock(&shard->lock);
+    for (statcache_entry_t *entry = *to_bucket(shard, hash); entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            *st = entry->st;
+            lru_unlink(shard, entry);
+            lru_push(shard, entry);
+            shard->hits++;
+            pthread_mutex_unlock(&shard->lock);
+            return 0;
+        }
+    }
+    shard->misses++;
+    unsigned long start = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (stat(path, st) == -1) {
+        return -1;
+    }
+    if (!watch_path(path, st)) {
+        return 0;
+    }
+    // Changes before the watch existed are not reported, so stat again;
+    // any change from here on bumps the generation
+    statcache_entry_t *entry = malloc(sizeof(statcache_entry_t) + strlen(path) + 1);
+    if (entry == NULL || stat(path, &entry->st) == -1) {
+        free(entry);
+        return 0;
+    }
+    *st = entry->st;
+    entry->hash = hash;
+    strcpy(entry->path, path);
+
+    pthread_mutex_lock(&shard->lock);
+    int duplicate = 0;
+    for (statcache_entry_t *other = *to_bucket(shard, hash); other != NULL; other = other->next) {
+        duplicate |= other->hash == hash && strcmp(other->path, path) == 0;
+    }
+    if (duplicate || changed_since(shard, hash, start)) {
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return 0;
+    }
+    if (shard->num_entries >= STATCACHE_SHARD_CAPACITY) {
+        remove_entry(shard, shard->lru_tail);
+    }
+    statcache_entry_t **bucket = to_bucket(shard, hash);
+    entry->next = *bucket;
+    *bucket = entry;
+    lru_push(shard, entry);
+    shard->num_entries++;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+/**
+ * Sums counters of all shards into out
+ *
+ * @param out return stats
+ */
+void statcache_get_stats(statcache_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < STATCACHE_SHARDS; i++) {
+        statcache_shard_t *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        out->entries += shard->num_entries;
+        out->hits += shard->hits;
+        out->misses += shard->misses;
+        out->invalidations += shard->invalidations;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
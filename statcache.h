@@ -0,0 +1,25 @@
+#ifndef __STATCACHE_H__
+#define __STATCACHE_H__
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define STATCACHE_SHARDS 16
+#define STATCACHE_BUCKETS 1024         // per shard
+#define STATCACHE_SHARD_CAPACITY 4096  // entries per shard before LRU eviction
+#define STATCACHE_RECENT 64            // invalidations per shard remembered for racing lookups
+
+typedef struct statcache_stats_s {
+    size_t entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;
+} statcache_stats_t;
+
+int statcache_init();
+
+int statcache_stat(const char *path, struct stat *st);
+
+void statcache_get_stats(statcache_stats_t *stats);
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * @file storage.c
+ * Storage backend interface and the default filesystem backend
+ *
+ * The filesystem backend serves root_directory as it is on disk, with
+ * metadata from the stat cache and file contents sent with send_file.
+ *
+ * Public variables:
+ * - fs_storage
+ * - storage
+ *
+ */
+
+#include "storage.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "coalesce.h"
+#include "dir.h"
+#include "statcache.h"
+#include "transfer.h"
+
+static void fs_canonicalize(const char *path, char outpath[]) {
+    realpath(path, outpath);
+}
+
+/**
+ * Opens path for reading; the size is taken from the open file as it may
+ * have changed since it was cached
+ *
+ * @return 1 if path is an open regular file; else 0
+ */
+static int fs_open(const char *path, storage_file_t *file, struct stat *st) {
+    file->fd = open(path, O_RDONLY);
+    file->offset = 0;
+    if (file->fd != -1 && fstat(file->fd, st) == 0 && S_ISREG(st->st_mode)) {
+        return 1;
+    }
+    if (file->fd != -1) {
+        close(file->fd);
+        file->fd = -1;
+    }
+    return 0;
+}
+
+static off_t fs_send(int outfd, storage_file_t *file, const char *path, off_t size, int ascii) {
+    if (ascii) {
+        return send_ascii(outfd, file->fd);
+    }
+    if (coalesce_min > 0 && size >= coalesce_min) {
+        return coalesce_send(outfd, file->fd, size);
+    }
+    return send_file(outfd, file->fd, size);
+}
+
+static void fs_close(storage_file_t *file) {
+    close(file->fd);
+    file->fd = -1;
+}
+
+static int fs_list(int outfd, const char *dirpath) {
+    return listFiles(outfd, (char *)dirpath);
+}
+
+const storage_t fs_storage = {
+    .name = "filesystem",
+    .canonicalize = fs_canonicalize,
+    .stat = statcache_stat,
+    .open = fs_open,
+    .send = fs_send,
+    .close = fs_close,
+    .list = fs_list,
+    .send_tar = send_tar,
+};
+
+const storage_t *storage = &fs_storage;
@@ -0,0 +1,29 @@
+#ifndef __STORAGE_H__
+#define __STORAGE_H__
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Readable file opened by a storage backend
+typedef struct storage_file_s {
+    int fd;        // fd holding the file contents
+    off_t offset;  // start of the contents in fd
+} storage_file_t;
+
+// Backend serving paths under root_directory. Paths passed to a backend
+// are canonical paths as produced by its canonicalize.
+typedef struct storage_s {
+    const char *name;
+    void (*canonicalize)(const char *path, char outpath[]);
+    int (*stat)(const char *path, struct stat *st);
+    int (*open)(const char *path, storage_file_t *file, struct stat *st);
+    off_t (*send)(int outfd, storage_file_t *file, const char *path, off_t size, int ascii);
+    void (*close)(storage_file_t *file);
+    int (*list)(int outfd, const char *dirpath);
+    int (*send_tar)(int outfd, char *dirpath, char *name);  // NULL if unsupported
+} storage_t;
+
+extern const storage_t fs_storage;
+extern const storage_t *storage;
+
+#endif
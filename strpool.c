@@ -0,0 +1,129 @@
+/**
+ * @file strpool.c
+ * Pool of interned, reference counted strings shared between sessions
+ *
+ * Public functions:
+ * - strpool_intern
+ * - strpool_acquire
+ * - strpool_release
+ * - strpool_get_stats
+ *
+ */
+
+#include "strpool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct strpool_entry_s {
+    struct strpool_entry_s *next;
+    unsigned int hash;
+    unsigned int refcount;
+    char str[];
+} strpool_entry_t;
+
+static strpool_entry_t *buckets[STRPOOL_BUCKETS];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static strpool_stats_t stats;
+
+static strpool_entry_t *to_entry(const char *str) {
+    return (strpool_entry_t *)(str - offsetof(strpool_entry_t, str));
+}
+
+// FNV-1a
+static unsigned int hash_str(const char *str) {
+    unsigned int hash = 2166136261u;
+    for (; *str != '\0'; str++) {
+        hash = (hash ^ (unsigned char)*str) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Returns the shared copy of str, adding it to the pool if needed.
+ * Each call holds a reference that is dropped with strpool_release.
+ *
+ * @param str string to intern
+ * @return interned string; NULL if out of memory
+ */
+const char *strpool_intern(const char *str) {
+    unsigned int hash = hash_str(str);
+    strpool_entry_t **bucket = &buckets[hash % STRPOOL_BUCKETS];
+    pthread_mutex_lock(&pool_lock);
+    strpool_entry_t *entry;
+    for (entry = *bucket; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->str, str) == 0) {
+            break;
+        }
+    }
+    if (entry == NULL) {
+        size_t len = strlen(str);
+        entry = malloc(sizeof(strpool_entry_t) + len + 1);
+        if (entry == NULL) {
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        memcpy(entry->str, str, len + 1);
+        entry->hash = hash;
+        entry->refcount = 0;
+        entry->next = *bucket;
+        *bucket = entry;
+        stats.num_strings++;
+        stats.bytes += sizeof(strpool_entry_t) + len + 1;
+    }
+    entry->refcount++;
+    stats.num_refs++;
+    pthread_mutex_unlock(&pool_lock);
+    return entry->str;
+}
+
+/**
+ * Takes another reference to an interned string
+ *
+ * @param str string returned by strpool_intern
+ * @return str
+ */
+const char *strpool_acquire(const char *str) {
+    pthread_mutex_lock(&pool_lock);
+    to_entry(str)->refcount++;
+    stats.num_refs++;
+    pthread_mutex_unlock(&pool_lock);
+    return str;
+}
+
+/**
+ * Drops a reference to an interned string, freeing it with the last one
+ *
+ * @param str string returned by strpool_intern; ignored if NULL
+ */
+void strpool_release(const char *str) {
+    if (str == NULL) {
+        return;
+    }
+    strpool_entry_t *entry = to_entry(str);
+    pthread_mutex_lock(&pool_lock);
+    stats.num_refs--;
+    if (--entry->refcount == 0) {
+        strpool_entry_t **link = &buckets[entry->hash % STRPOOL_BUCKETS];
+        while (*link != entry) {
+            link = &(*link)->next;
+        }
+        *link = entry->next;
+        stats.num_strings--;
+        stats.bytes -= sizeof(strpool_entry_t) + strlen(entry->str) + 1;
+        free(entry);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Copies a snapshot of pool counters into out
+ *
+ * @param out return stats
+ */
+void strpool_get_stats(strpool_stats_t *out) {
+    pthread_mutex_lock(&pool_lock);
+    *out = stats;
+    pthread_mutex_unlock(&pool_lock);
+}
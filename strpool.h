@@ -0,0 +1,22 @@
+#ifndef __STRPOOL_H__
+#define __STRPOOL_H__
+
+#include <stddef.h>
+
+#define STRPOOL_BUCKETS 1024
+
+typedef struct strpool_stats_s {
+    size_t num_strings;
+    size_t num_refs;
+    size_t bytes;
+} strpool_stats_t;
+
+const char *strpool_intern(const char *str);
+
+const char *strpool_acquire(const char *str);
+
+void strpool_release(const char *str);
+
+void strpool_get_stats(strpool_stats_t *stats);
+
+#endif
@@ -6,12 +6,19 @@
  * - open_port
  * - get_socket_port
  * - is_valid_port
+ * - steer_by_cpu
  *
  */
 
 #include "tcpserver.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <linux/filter.h>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
 
 /**
  * Binds a new socket to given port if port is nonzero;
@@ -39,7 +46,8 @@ int open_port(int port) {
         printf("Socket bind to %d failed\n", port);
         return -1;
     }
-    listen(fd, 5);
+    // Connections queue here while a reloaded process starts up
+    listen(fd, SOMAXCONN);
     return fd;
 }
 
@@ -57,3 +65,41 @@ int get_socket_port(int fd) {
     }
     return ntohs(sin.sin_port);
 }
+
+/**
+ * Steers each connection to the SO_REUSEPORT group of fd to the socket at
+ * index socket_of_cpu[cpu], cpu being the CPU that received it. Indices
+ * follow the order in which the sockets of the group started listening.
+ * CPUs mapped to -1, or beyond num_cpus, use socket (cpu % num_sockets).
+ *
+ * The classic BPF program compares the CPU against each CPU whose socket
+ * differs from that default, so a dense CPU set needs no comparisons.
+ *
+ * @param fd listening socket in the group
+ * @param socket_of_cpu socket index of each CPU, or -1
+ * @param num_cpus length of socket_of_cpu
+ * @param num_sockets number of sockets in the group
+ * @return 1 if the program was attached; else 0 and the kernel spreads
+ *         connections by hash
+ */
+int steer_by_cpu(int fd, const int socket_of_cpu[], int num_cpus, int num_sockets) {
+    struct sock_filter *code = malloc((2 * num_cpus + 3) * sizeof(struct sock_filter));
+    if (code == NULL) {
+        return 0;
+    }
+    int len = 0;
+    code[len++] = (struct sock_filter){BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU};
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        if (socket_of_cpu[cpu] != -1 && socket_of_cpu[cpu] != cpu % num_sockets) {
+            code[len++] = (struct sock_filter){BPF_JMP | BPF_JEQ | BPF_K, 0, 1, cpu};
+            code[len++] = (struct sock_filter){BPF_RET | BPF_K, 0, 0, socket_of_cpu[cpu]};
+        }
+    }
+    code[len++] = (struct sock_filter){BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_sockets};
+    code[len++] = (struct sock_filter){BPF_RET | BPF_A, 0, 0, 0};
+    struct sock_fprog prog = {.len = len, .filter = code};
+    int attached = len <= BPF_MAXINSNS &&
+                   setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+    free(code);
+    return attached;
+}
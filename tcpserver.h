@@ -12,4 +12,6 @@ int open_port(int port);
 
 int get_socket_port(int fd);
 
+int steer_by_cpu(int fd, const int socket_of_cpu[], int num_cpus, int num_sockets);
+
 #endif
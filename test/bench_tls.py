@@ -0,0 +1,50 @@
+#!/usr/bin/python3
+"""Compares RETR throughput over plaintext and TLS (PROT P) data connections"""
+import ftplib
+import ssl
+import sys
+import time
+
+def bench(client: ftplib.FTP, filename: str, runs: int) -> float:
+    """Returns mean throughput of downloading filename in MB/s"""
+    total_bytes = 0
+    start = time.perf_counter()
+    for _ in range(runs):
+        received = [0]
+        def count(block: bytes):
+            received[0] += len(block)
+        client.retrbinary(f"RETR {filename}", count, blocksize=1 << 20)
+        total_bytes += received[0]
+    elapsed = time.perf_counter() - start
+    return total_bytes / elapsed / 1e6
+
+def main():
+    if len(sys.argv) < 3 or not sys.argv[1].isdigit():
+        print(f"usage: python3 {sys.argv[0]} <port> <file> [runs]")
+        return
+    port = int(sys.argv[1])
+    filename = sys.argv[2]
+    runs = int(sys.argv[3]) if len(sys.argv) > 3 else 5
+
+    plain = ftplib.FTP()
+    plain.connect(host="localhost", port=port)
+    plain.login("anonymous", "anonymous")
+    plain_rate = bench(plain, filename, runs)
+    plain.close()
+
+    # Self-signed test certificates are not verified
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    context.check_hostname = False
+    context.verify_mode = ssl.CERT_NONE
+    secure = ftplib.FTP_TLS(context=context)
+    secure.connect(host="localhost", port=port)
+    secure.login("anonymous", "anonymous")
+    secure.prot_p()
+    tls_rate = bench(secure, filename, runs)
+    secure.close()
+
+    print(f"plaintext: {plain_rate:.1f} MB/s")
+    print(f"TLS:       {tls_rate:.1f} MB/s ({tls_rate / plain_rate:.0%} of plaintext)")
+
+if __name__ == "__main__":
+    main()
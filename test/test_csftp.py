@@ -2,6 +2,9 @@
 import os
 import sys
 import ftplib
+import socket
+import tarfile
+import time
 
 testdir = "test"
 outdir = os.path.join(testdir, "out")
@@ -179,6 +182,160 @@ def test_retr_image(port: int):
     client.close()
     print(f"Received {outpath}")
 
+def test_site_tar(port: int):
+    client = __create_client(port)
+    send_print("USER anonymous")
+    recv_print(client.login('anonymous', 'anonymous'))
+    outpath = os.path.join(outdir, "data.tar")
+    with open(outpath, "wb") as f:
+        command = f"SITE TAR {datadir}"
+        send_print(command)
+        recv_print(client.retrbinary(command, f.write))
+    client.close()
+    with tarfile.open(outpath) as tar:
+        names = tar.getnames()
+        assert "data/answer.txt" in names
+        assert "data/images/guin.jpg" in names
+        for member in tar.getmembers():
+            if not member.isfile():
+                continue
+            filepath = os.path.join(os.path.dirname(datadir), member.name)
+            with open(filepath, "rb") as f:
+                assert tar.extractfile(member).read() == f.read(), member.name
+    print(f"Received {outpath}")
+
+def test_size_mdtm(port: int):
+    client = __create_client(port)
+    send_print("USER anonymous")
+    recv_print(client.login('anonymous', 'anonymous'))
+    filepath = os.path.join(datadir, "authors.txt")
+    send_print(f"SIZE {filepath}")
+    size = client.size(filepath)
+    recv_print(f"213 {size}")
+    assert size == os.path.getsize(filepath)
+    send_print(f"MDTM {filepath}")
+    reply = client.voidcmd(f"MDTM {filepath}")
+    recv_print(reply)
+    assert reply.startswith("213 ")
+    try:
+        send_print(f"SIZE {datadir}")
+        client.size(datadir)
+        assert False, "SIZE of a directory succeeded"
+    except ftplib.error_perm as err:
+        recv_print(err.args[0])
+        assert err.args[0].startswith("550")
+    client.close()
+
+def test_mlst(port: int):
+    client = __create_client(port)
+    send_print("USER anonymous")
+    recv_print(client.login('anonymous', 'anonymous'))
+    filepath = os.path.join(datadir, "authors.txt")
+    send_print(f"MLST {filepath}")
+    reply = client.sendcmd(f"MLST {filepath}")
+    recv_print(reply)
+    assert reply.startswith("250")
+    assert "type=file;" in reply
+    assert f"size={os.path.getsize(filepath)};" in reply
+    send_print(f"MLST {datadir}")
+    reply = client.sendcmd(f"MLST {datadir}")
+    recv_print(reply)
+    assert "type=dir;" in reply
+    try:
+        send_print(f"MLST {datadir}/missing.txt")
+        client.sendcmd(f"MLST {datadir}/missing.txt")
+        assert False, "MLST of a missing file succeeded"
+    except ftplib.error_perm as err:
+        recv_print(err.args[0])
+        assert err.args[0].startswith("550")
+    client.close()
+
+def test_active_mode(port: int):
+    client = __create_client(port)
+    send_print("USER anonymous")
+    recv_print(client.login('anonymous', 'anonymous'))
+    filepath = os.path.join(datadir, "authors.txt")
+    with open(filepath, "rb") as f:
+        expected = f.read()
+    client.set_pasv(False)
+    data = bytearray()
+    command = f"RETR {filepath}"
+    send_print(f"PORT, then {command}")
+    recv_print(client.retrbinary(command, data.extend))
+    assert data == expected
+    with socket.create_server(("127.0.0.1", 0)) as listener:
+        host, dataport = listener.getsockname()
+        send_print(f"EPRT |1|{host}|{dataport}|")
+        recv_print(client.sendeprt(host, dataport))
+        send_print(command)
+        recv_print(client.sendcmd(command))
+        conn, _ = listener.accept()
+        data = bytearray()
+        with conn:
+            while chunk := conn.recv(65536):
+                data.extend(chunk)
+        recv_print(client.voidresp())
+    assert data == expected
+    client.close()
+
+def test_retr_ascii(port: int):
+    client = __create_client(port)
+    send_print("USER anonymous")
+    recv_print(client.login('anonymous', 'anonymous'))
+    filepath = os.path.join(datadir, "answer.txt")
+    send_print("TYPE A")
+    recv_print(client.voidcmd("TYPE A"))
+    send_print(f"RETR {filepath}")
+    received = b""
+    with client.transfercmd(f"RETR {filepath}") as conn:
+        while data := conn.recv(8192):
+            received += data
+    recv_print(client.voidresp())
+    with open(filepath, "rb") as f:
+        expected = f.read().replace(b"\r\n", b"\n").replace(b"\n", b"\r\n")
+    assert received == expected
+    client.close()
+
+def test_retr_ascii_tail(port: int):
+    # A newline inside the last full vector of a page-sized file
+    filepath = os.path.join(outdir, "ascii_tail.txt")
+    content = b"a" * 4084 + b"\n" + b"b" * 11
+    with open(filepath, "wb") as f:
+        f.write(content)
+    client = __create_client(port)
+    send_print("USER anonymous")
+    recv_print(client.login('anonymous', 'anonymous'))
+    send_print("TYPE A")
+    recv_print(client.voidcmd("TYPE A"))
+    send_print(f"RETR {filepath}")
+    received = b""
+    with client.transfercmd(f"RETR {filepath}") as conn:
+        while data := conn.recv(8192):
+            received += data
+    recv_print(client.voidresp())
+    assert received == content.replace(b"\n", b"\r\n")
+    client.close()
+
+def test_site_find(port: int):
+    client = __create_client(port)
+    send_print("USER anonymous")
+    recv_print(client.login('anonymous', 'anonymous'))
+    send_print("CWD " + datadir)
+    recv_print(client.cwd(datadir))
+    send_print("SITE FIND *.jpg")
+    # The index is built in the background after the server starts
+    for attempt in range(100):
+        paths = []
+        try:
+            recv_print(client.retrlines("SITE FIND *.jpg", paths.append))
+            break
+        except ftplib.error_temp as error:
+            recv_print(str(error))
+            time.sleep(0.1)
+    assert f"/{imagedir}/guin.jpg" in paths
+    assert all(path.startswith(f"/{datadir}/") for path in paths)
+    client.close()
+
 def __create_client(port: int):
     ftp = ftplib.FTP()
     try:
@@ -238,6 +395,20 @@ def main():
     test_retr_txt2(port)
     print_test_header("RETR image file")
     test_retr_image(port)
+    print_test_header("SITE TAR")
+    test_site_tar(port)
+    print_test_header("SIZE and MDTM")
+    test_size_mdtm(port)
+    print_test_header("MLST")
+    test_mlst(port)
+    print_test_header("PORT and EPRT")
+    test_active_mode(port)
+    print_test_header("RETR in ASCII type")
+    test_retr_ascii(port)
+    print_test_header("RETR in ASCII type, newline in last vector")
+    test_retr_ascii_tail(port)
+    print_test_header("SITE FIND")
+    test_site_find(port)
     sys.stdout.write("\n")
 
 if __name__ == "__main__":
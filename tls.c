@@ -0,0 +1,183 @@
+/**
+ * @file tls.c
+ * TLS for control and data connections, offloaded to kernel TLS
+ *
+ * The handshake is done by OpenSSL, after which record encryption is handed
+ * to the kernel (TCP_ULP "tls"). Offloaded sockets are then used with plain
+ * read, write and sendfile, so encrypted transfers keep the zero-copy path.
+ * Connections that cannot be offloaded are refused rather than falling back
+ * to user-space TLS. Built only with `make TLS=1`.
+ *
+ * Public functions:
+ * - tls_init
+ * - tls_enabled
+ * - tls_accept
+ * - tls_close
+ *
+ */
+
+#include "tls.h"
+
+#include <stdio.h>
+
+#ifdef JSFTP_TLS
+
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+static SSL_CTX *ctx = NULL;
+
+/**
+ * Checks whether the kernel can offload TLS by attaching the "tls" ULP to a
+ * connected loopback socket
+ *
+ * @return 1 if kernel TLS is available; else 0
+ */
+static int probe_ktls() {
+    int available = 0;
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    int connfd = socket(AF_INET, SOCK_STREAM, 0);
+    int acceptfd = -1;
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listenfd != -1 && connfd != -1 &&
+        bind(listenfd, (struct sockaddr *)&sin, sizeof(sin)) == 0 &&
+        listen(listenfd, 1) == 0 &&
+        getsockname(listenfd, (struct sockaddr *)&sin, &len) == 0 &&
+        connect(connfd, (struct sockaddr *)&sin, sizeof(sin)) == 0 &&
+        (acceptfd = accept(listenfd, NULL, NULL)) != -1) {
+        available = setsockopt(connfd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+    }
+    if (acceptfd != -1) {
+        close(acceptfd);
+    }
+    if (connfd != -1) {
+        close(connfd);
+    }
+    if (listenfd != -1) {
+        close(listenfd);
+    }
+    return available;
+}
+
+/**
+ * Loads the server certificate and enables AUTH TLS if the kernel can
+ * offload TLS
+ *
+ * @param certfile PEM certificate chain
+ * @param keyfile PEM private key
+ * @return 1 if TLS is enabled; else 0
+ */
+int tls_init(const char *certfile, const char *keyfile) {
+#ifndef SSL_OP_ENABLE_KTLS
+    printf("TLS disabled: OpenSSL was built without kernel TLS support\n");
+    return 0;
+#else
+    if (!probe_ktls()) {
+        printf("TLS disabled: kernel TLS is unavailable\n");
+        return 0;
+    }
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        return 0;
+    }
+    // OpenSSL only offloads receiving for TLS 1.2 with AES-GCM
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"JSftp", 5);
+    if (SSL_CTX_use_certificate_chain_file(ctx, certfile) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyfile, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        printf("TLS disabled: could not load certificate %s and key %s\n", certfile, keyfile);
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return 0;
+    }
+    return 1;
+#endif
+}
+
+/**
+ * @return 1 if tls_init succeeded; else 0
+ */
+int tls_enabled() {
+    return ctx != NULL;
+}
+
+/**
+ * Performs the server side of a TLS handshake on fd and offloads the
+ * connection to the kernel, after which fd is used directly
+ *
+ * @param fd connected socket
+ * @param offload_recv 1 if received records must also be offloaded
+ * @return connection to pass to tls_close; NULL if the handshake or the
+ *         offload failed
+ */
+tls_conn_t *tls_accept(int fd, int offload_recv) {
+    if (ctx == NULL) {
+        return NULL;
+    }
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL) {
+        return NULL;
+    }
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) != 1 || !BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+        (offload_recv && !BIO_get_ktls_recv(SSL_get_rbio(ssl)))) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        return NULL;
+    }
+    return (tls_conn_t *)ssl;
+}
+
+/**
+ * Sends close_notify and frees conn. The socket is left open.
+ *
+ * @param conn connection returned by tls_accept; ignored if NULL
+ */
+void tls_close(tls_conn_t *conn) {
+    if (conn == NULL) {
+        return;
+    }
+    SSL *ssl = (SSL *)conn;
+    SSL_shutdown(ssl);
+    ERR_clear_error();
+    SSL_free(ssl);
+}
+
+#else
+
+int tls_init(const char *certfile, const char *keyfile) {
+    printf("TLS disabled: server was built without TLS=1\n");
+    return 0;
+}
+
+int tls_enabled() {
+    return 0;
+}
+
+tls_conn_t *tls_accept(int fd, int offload_recv) {
+    return NULL;
+}
+
+void tls_close(tls_conn_t *conn) {
+}
+
+#endif
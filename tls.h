@@ -0,0 +1,17 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#define TLS_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+
+typedef struct tls_conn_s tls_conn_t;
+
+int tls_init(const char *certfile, const char *keyfile);
+
+int tls_enabled();
+
+tls_conn_t *tls_accept(int fd, int offload_recv);
+
+void tls_close(tls_conn_t *conn);
+
+#endif
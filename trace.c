@@ -0,0 +1,207 @@
+/**
+ * @file trace.c
+ * Compact binary trace of control session activity
+ *
+ * A trace is TRACE_MAGIC and a monotonic epoch followed by trace_record_t
+ * headers, each followed by its payload. Records are appended by any thread
+ * under one lock. The file is opened for appending, so a server reloaded
+ * with SIGHUP keeps adding to the trace its predecessor is still writing;
+ * each process buffers whole records and writes them with a single write()
+ * so records of the two never interleave, and tags them with its pid since
+ * session ids restart in the new process.
+ *
+ * Public functions:
+ * - trace_open
+ * - trace_enabled
+ * - trace_now_us
+ * - trace_write
+ * - trace_close
+ * - trace_open_read
+ * - trace_read
+ *
+ */
+
+#include "trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static int trace_fd = -1;
+static uint32_t trace_pid;
+static uint64_t trace_epoch_us;
+static char trace_buf[TRACE_BUF_SIZE];
+static size_t trace_buf_len;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Writes out the buffered records; trace_lock must be held
+ */
+static void flush_records() {
+    size_t done = 0;
+    while (done < trace_buf_len) {
+        ssize_t n = write(trace_fd, trace_buf + done, trace_buf_len - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    trace_buf_len = 0;
+}
+
+/**
+ * Opens the trace file at path for appending, creating it if needed.
+ * Timestamps are relative to the epoch in the file header, so a process that
+ * joins an existing trace shares the clock of the one that created it.
+ *
+ * @param path trace file path
+ * @return 1 on success; else 0
+ */
+int trace_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        return 0;
+    }
+    // Serialize header creation with another process opening the same file
+    struct stat st;
+    char header[TRACE_HEADER_LEN];
+    if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+        close(fd);
+        return 0;
+    }
+    uint64_t epoch_us;
+    if (st.st_size == 0) {
+        epoch_us = monotonic_us();
+        memcpy(header, TRACE_MAGIC, TRACE_MAGIC_LEN);
+        memcpy(header + TRACE_MAGIC_LEN, &epoch_us, sizeof(epoch_us));
+        if (write(fd, header, TRACE_HEADER_LEN) != TRACE_HEADER_LEN) {
+            close(fd);
+            return 0;
+        }
+    } else if (pread(fd, header, TRACE_HEADER_LEN, 0) != TRACE_HEADER_LEN ||
+               memcmp(header, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        close(fd);
+        return 0;
+    } else {
+        memcpy(&epoch_us, header + TRACE_MAGIC_LEN, sizeof(epoch_us));
+    }
+    flock(fd, LOCK_UN);
+    trace_epoch_us = epoch_us;
+    trace_pid = getpid();
+    trace_buf_len = 0;
+    trace_fd = fd;
+    return 1;
+}
+
+/**
+ * @return 1 if a trace is being written; else 0
+ */
+int trace_enabled() {
+    return trace_fd != -1;
+}
+
+/**
+ * @return microseconds since the trace epoch
+ */
+uint64_t trace_now_us() {
+    uint64_t now_us = monotonic_us();
+    return now_us > trace_epoch_us ? now_us - trace_epoch_us : 0;
+}
+
+/**
+ * Appends a record to the trace if enabled
+ *
+ * @param session_id session the record belongs to
+ * @param type record type
+ * @param timestamp_us time of the event from trace_now_us
+ * @param value latency or byte count, depending on type
+ * @param payload record payload; may be NULL if len is 0
+ * @param len payload length, truncated to TRACE_MAX_PAYLOAD
+ */
+void trace_write(uint32_t session_id, trace_type_t type, uint64_t timestamp_us,
+                 uint64_t value, const char *payload, uint16_t len) {
+    if (trace_fd == -1) {
+        return;
+    }
+    trace_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp_us = timestamp_us;
+    record.value = value;
+    record.session_id = session_id;
+    record.pid = trace_pid;
+    record.len = len < TRACE_MAX_PAYLOAD ? len : TRACE_MAX_PAYLOAD;
+    record.type = type;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_buf_len + sizeof(record) + record.len > TRACE_BUF_SIZE) {
+        flush_records();
+    }
+    memcpy(trace_buf + trace_buf_len, &record, sizeof(record));
+    if (record.len > 0) {
+        memcpy(trace_buf + trace_buf_len + sizeof(record), payload, record.len);
+    }
+    trace_buf_len += sizeof(record) + record.len;
+    if (type == TRACE_CLOSE) {
+        flush_records();
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Flushes and closes the trace
+ */
+void trace_close() {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd != -1) {
+        flush_records();
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Opens a trace for reading and checks its magic
+ *
+ * @param path trace file path
+ * @return file positioned at the first record; NULL if not a trace
+ */
+FILE *trace_open_read(const char *path) {
+    FILE *file = fopen(path, "rb");
+    char header[TRACE_HEADER_LEN];
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fread(header, 1, TRACE_HEADER_LEN, file) != TRACE_HEADER_LEN ||
+        memcmp(header, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * Reads the next record of a trace
+ *
+ * @param file trace from trace_open_read
+ * @param record return record header
+ * @param payload return NUL-terminated payload
+ * @return 1 if a record was read; 0 at end of trace or on a truncated record
+ */
+int trace_read(FILE *file, trace_record_t *record, char payload[TRACE_MAX_PAYLOAD + 1]) {
+    if (fread(record, sizeof(*record), 1, file) != 1 || record->len > TRACE_MAX_PAYLOAD ||
+        fread(payload, 1, record->len, file) != record->len) {
+        return 0;
+    }
+    payload[record->len] = '\0';
+    return 1;
+}
@@ -0,0 +1,48 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC "JSFTPTR2"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_MAX_PAYLOAD 1024
+#define TRACE_BUF_SIZE (64 * 1024)
+
+typedef enum {
+    TRACE_OPEN = 1,   // session connected
+    TRACE_COMMAND,    // command line; value is latency in us
+    TRACE_TRANSFER,   // value is bytes sent on the data connection
+    TRACE_CLOSE       // session disconnected
+} trace_type_t;
+
+// File header: TRACE_MAGIC, then the monotonic epoch shared by every writer
+#define TRACE_HEADER_LEN (TRACE_MAGIC_LEN + sizeof(uint64_t))
+
+// Fixed-size record header in host byte order, followed by len payload bytes
+typedef struct trace_record_s {
+    uint64_t timestamp_us;  // since the trace epoch
+    uint64_t value;
+    uint32_t session_id;    // unique within pid
+    uint32_t pid;           // process that wrote the record
+    uint16_t len;
+    uint8_t type;
+    uint8_t reserved[5];
+} trace_record_t;
+
+int trace_open(const char *path);
+
+int trace_enabled();
+
+uint64_t trace_now_us();
+
+void trace_write(uint32_t session_id, trace_type_t type, uint64_t timestamp_us,
+                 uint64_t value, const char *payload, uint16_t len);
+
+void trace_close();
+
+FILE *trace_open_read(const char *path);
+
+int trace_read(FILE *file, trace_record_t *record, char payload[TRACE_MAX_PAYLOAD + 1]);
+
+#endif
@@ -0,0 +1,342 @@
+/**
+ * @file transfer.c
+ * Sends file contents over a data connection
+ *
+ * Small files go out with sendfile. Large files additionally get explicit
+ * readahead ahead of the send cursor and have their pages dropped behind it,
+ * so one huge download does not evict the page cache of everyone else.
+ * Above direct_threshold files bypass the page cache entirely with O_DIRECT
+ * reads into two buffers, one filled while the other is sent.
+ * ASCII type transfers are read and written through a buffer as their
+ * line endings are translated.
+ *
+ * Public functions:
+ * - write_all
+ * - send_file
+ * - send_file_range
+ * - send_ascii
+ * - send_ascii_mapped
+ *
+ */
+
+#define _GNU_SOURCE
+#include "transfer.h"
+
+#include "ascii.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+off_t direct_threshold = 0;
+
+typedef struct direct_buf_s {
+    char *data;
+    ssize_t len;  // bytes read; at most skip at EOF; -1 on error
+    size_t skip;  // bytes before the next byte to send, read to keep alignment
+    int full;
+} direct_buf_t;
+
+typedef struct direct_reader_s {
+    int fd;
+    int stop;
+    direct_buf_t bufs[2];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} direct_reader_t;
+
+/**
+ * Writes all bytes of buf to fd
+ *
+ * @return 0 if all bytes were written; else -1
+ */
+int write_all(int fd, const void *buf, size_t len) {
+    const char *bytes = buf;
+    while (len > 0) {
+        ssize_t wrote = write(fd, bytes, len);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            return -1;
+        }
+        bytes += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+/**
+ * Sends size bytes of infd from start with sendfile. For files of at least
+ * LARGE_FILE_THRESHOLD bytes the next READAHEAD_WINDOW is requested before
+ * each window is sent, and pages more than a window behind the cursor are
+ * dropped from the cache; the lag leaves the socket time to release pages
+ * it still references.
+ *
+ * @return bytes sent; -1 on write failure
+ */
+static off_t send_cached(int outfd, int infd, off_t start, off_t size) {
+    int large = size >= LARGE_FILE_THRESHOLD;
+    off_t end = start + size;
+    posix_fadvise(infd, start, size, POSIX_FADV_SEQUENTIAL);
+    if (large) {
+        posix_fadvise(infd, start, READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+    }
+
+    off_t offset = start;
+    off_t dropped = start;
+    while (offset < end) {
+        off_t window_end = offset + READAHEAD_WINDOW < end ? offset + READAHEAD_WINDOW : end;
+        if (large) {
+            posix_fadvise(infd, window_end, READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+        }
+        while (offset < window_end) {
+            ssize_t sent = sendfile(outfd, infd, &offset, window_end - offset);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0) {
+                return -1;
+            }
+            if (sent == 0) {
+                return offset - start;  // file shrank
+            }
+        }
+        if (large && offset - READAHEAD_WINDOW > dropped) {
+            posix_fadvise(infd, dropped, offset - READAHEAD_WINDOW - dropped, POSIX_FADV_DONTNEED);
+            dropped = offset - READAHEAD_WINDOW;
+        }
+    }
+    return offset - start;
+}
+
+/**
+ * Reader thread of send_direct: fills buffers alternately until EOF. Reads
+ * start at the aligned offset at or before the next byte to send, so a
+ * short read does not leave later reads misaligned for O_DIRECT; the bytes
+ * read again are skipped.
+ *
+ * @param reader_data direct_reader_t
+ * @return NULL
+ */
+static void *read_direct(void *reader_data) {
+    direct_reader_t *reader = reader_data;
+    off_t offset = 0;
+    for (int i = 0;; i ^= 1) {
+        direct_buf_t *buf = &reader->bufs[i];
+        pthread_mutex_lock(&reader->lock);
+        while (buf->full && !reader->stop) {
+            pthread_cond_wait(&reader->cond, &reader->lock);
+        }
+        int stop = reader->stop;
+        pthread_mutex_unlock(&reader->lock);
+        if (stop) {
+            break;
+        }
+
+        off_t start = offset & ~(off_t)(DIRECT_ALIGN - 1);
+        ssize_t len;
+        do {
+            len = pread(reader->fd, buf->data, DIRECT_BUF_SIZE, start);
+        } while (len < 0 && errno == EINTR);
+
+        pthread_mutex_lock(&reader->lock);
+        buf->len = len;
+        buf->skip = offset - start;
+        buf->full = 1;
+        pthread_cond_broadcast(&reader->cond);
+        pthread_mutex_unlock(&reader->lock);
+        if (len <= (ssize_t)(offset - start)) {
+            break;
+        }
+        offset = start + len;
+    }
+    return NULL;
+}
+
+/**
+ * Sends file infd read with O_DIRECT, bypassing the page cache. O_DIRECT
+ * is set on infd itself, so the file sent is the one that was looked up and
+ * no path is resolved on the session thread.
+ *
+ * @return bytes sent, less than size if the file shrank; -1 on read or
+ *         write failure; -2 if O_DIRECT is unavailable
+ */
+static off_t send_direct(int outfd, int infd, off_t size) {
+    int flags = fcntl(infd, F_GETFL);
+    if (flags == -1 || fcntl(infd, F_SETFL, flags | O_DIRECT) == -1) {
+        return -2;
+    }
+    direct_reader_t reader;
+    reader.fd = infd;
+    reader.stop = 0;
+    for (int i = 0; i < 2; i++) {
+        reader.bufs[i].full = 0;
+        if (posix_memalign((void **)&reader.bufs[i].data, DIRECT_ALIGN, DIRECT_BUF_SIZE) != 0) {
+            reader.bufs[i].data = NULL;
+        }
+    }
+    pthread_mutex_init(&reader.lock, NULL);
+    pthread_cond_init(&reader.cond, NULL);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, DIRECT_STACK_SIZE);
+    if (reader.bufs[0].data == NULL || reader.bufs[1].data == NULL ||
+        pthread_create(&thread, &attr, read_direct, &reader) != 0) {
+        pthread_attr_destroy(&attr);
+        free(reader.bufs[0].data);
+        free(reader.bufs[1].data);
+        fcntl(infd, F_SETFL, flags);
+        return -2;
+    }
+    pthread_attr_destroy(&attr);
+
+    off_t offset = 0;
+    for (int i = 0; offset < size; i ^= 1) {
+        direct_buf_t *buf = &reader.bufs[i];
+        pthread_mutex_lock(&reader.lock);
+        while (!buf->full) {
+            pthread_cond_wait(&reader.cond, &reader.lock);
+        }
+        pthread_mutex_unlock(&reader.lock);
+        if (buf->len < 0) {
+            offset = -1;
+            break;
+        }
+        if (buf->len <= (ssize_t)buf->skip) {
+            break;  // file shrank
+        }
+
+        size_t len = buf->len - buf->skip;
+        len = len < size - offset ? len : size - offset;
+        if (write_all(outfd, buf->data + buf->skip, len) == -1) {
+            offset = -1;
+            break;
+        }
+        offset += len;
+
+        pthread_mutex_lock(&reader.lock);
+        buf->full = 0;
+        pthread_cond_broadcast(&reader.cond);
+        pthread_mutex_unlock(&reader.lock);
+    }
+
+    pthread_mutex_lock(&reader.lock);
+    reader.stop = 1;
+    pthread_cond_broadcast(&reader.cond);
+    pthread_mutex_unlock(&reader.lock);
+    pthread_join(thread, NULL);
+    pthread_mutex_destroy(&reader.lock);
+    pthread_cond_destroy(&reader.cond);
+    free(reader.bufs[0].data);
+    free(reader.bufs[1].data);
+    fcntl(infd, F_SETFL, flags);
+    return offset;
+}
+
+/**
+ * Sends size bytes of file infd to outfd
+ *
+ * @param outfd output fd
+ * @param infd file fd
+ * @param size size of file
+ * @return bytes sent, less than size if the file shrank; -1 on read or
+ *         write failure
+ */
+off_t send_file(int outfd, int infd, off_t size) {
+    if (direct_threshold > 0 && size >= direct_threshold) {
+        off_t sent = send_direct(outfd, infd, size);
+        if (sent != -2) {
+            return sent;
+        }
+    }
+    return send_cached(outfd, infd, 0, size);
+}
+
+/**
+ * Sends size bytes of infd starting at offset, such as one file of a pack
+ *
+ * @param outfd output fd
+ * @param infd file fd
+ * @param offset start of the range in infd
+ * @param size length of the range
+ * @return bytes sent; -1 on write failure
+ */
+off_t send_file_range(int outfd, int infd, off_t offset, off_t size) {
+    return send_cached(outfd, infd, offset, size);
+}
+
+/**
+ * Sends file infd with bare LF line endings translated to CRLF
+ *
+ * @param outfd output fd
+ * @param infd file fd
+ * @return bytes sent after translation; -1 on read or write failure
+ */
+off_t send_ascii(int outfd, int infd) {
+    char *in = malloc(ASCII_CHUNK_SIZE);
+    char *out = malloc(2 * ASCII_CHUNK_SIZE + ASCII_OUT_SLACK);
+    if (in == NULL || out == NULL) {
+        free(in);
+        free(out);
+        return -1;
+    }
+    posix_fadvise(infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    char last = '\0';
+    off_t total = 0;
+    while (1) {
+        ssize_t len = read(infd, in, ASCII_CHUNK_SIZE);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            if (len < 0) {
+                total = -1;
+            }
+            break;
+        }
+        size_t converted = lf_to_crlf(in, len, out, &last);
+        if (write_all(outfd, out, converted) == -1) {
+            total = -1;
+            break;
+        }
+        total += converted;
+    }
+    free(in);
+    free(out);
+    return total;
+}
+
+/**
+ * Sends len bytes of mapped file contents with bare LF line endings
+ * translated to CRLF
+ *
+ * @param outfd output fd
+ * @param data mapped contents
+ * @param len length of data
+ * @return bytes sent after translation; -1 on write failure
+ */
+off_t send_ascii_mapped(int outfd, const char *data, size_t len) {
+    char *out = malloc(2 * ASCII_CHUNK_SIZE + ASCII_OUT_SLACK);
+    if (out == NULL) {
+        return -1;
+    }
+    char last = '\0';
+    off_t total = 0;
+    for (size_t offset = 0; offset < len; offset += ASCII_CHUNK_SIZE) {
+        size_t chunk = len - offset < ASCII_CHUNK_SIZE ? len - offset : ASCII_CHUNK_SIZE;
+        size_t converted = lf_to_crlf(data + offset, chunk, out, &last);
+        if (write_all(outfd, out, converted) == -1) {
+            total = -1;
+            break;
+        }
+        total += converted;
+    }
+    free(out);
+    return total;
+}
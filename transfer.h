@@ -0,0 +1,25 @@
+#ifndef __TRANSFER_H__
+#define __TRANSFER_H__
+
+#include <sys/types.h>
+
+#define LARGE_FILE_THRESHOLD (64 * 1024 * 1024)
+#define READAHEAD_WINDOW (8 * 1024 * 1024)
+#define DIRECT_BUF_SIZE (1024 * 1024)
+#define DIRECT_ALIGN 4096
+#define DIRECT_STACK_SIZE (32 * 1024)
+
+// Files at least this large are read with O_DIRECT; 0 disables O_DIRECT
+extern off_t direct_threshold;
+
+int write_all(int fd, const void *buf, size_t len);
+
+off_t send_file(int outfd, int infd, off_t size);
+
+off_t send_file_range(int outfd, int infd, off_t offset, off_t size);
+
+off_t send_ascii(int outfd, int infd);
+
+off_t send_ascii_mapped(int outfd, const char *data, size_t len);
+
+#endif